@@ -26,96 +26,322 @@
 
 #include "Utilities.h"
 
+#include <type_traits>
+
 namespace corvid {
 
 //------------------------------------------------------------------------------
+/* 
+ *  Natives are bound by Fun::native, which works out from the C++ signature
+ *  how to unpack each argument and box the result.  Arguments are read
+ *  straight out of the evaluated argument array into the call, so a call
+ *  costs an indirect call plus the unboxing; nothing is copied into a tuple 
+ *  and nothing is allocated unless the native returns a heap value.
+ *
+ *  Parameters can be int, float, double, List*, Vector*, Array*, Dict*, 
+ *  Str*, Fun*, Expr* or a std::string, which is best taken by const 
+ *  reference to the Str's flattened text.  A trailing Rest parameter takes any 
+ *  remaining arguments, which makes the native variadic, and trailing 
+ *  Optional<T> parameters may be left out.  Any other missing argument is an
+ *  error, as are extra ones unless the native is variadic.
+ *
+ *  Function pointers, lambdas and member functions can all be bound.  A 
+ *  member function takes its receiver as the first argument.
+ */
+
+// The arguments a variadic native gets after its fixed parameters
+struct Rest {
+  Expr** ppArgs;
+  size_t count;
+};
 
-inline 
-void packListItem(List* pList, List*& l, Scope* pScope) {
-  if (pList && pList->get(0)) {
-    l = as<List>(pList->get(0)->eval(pScope));
-  } else {
-    l = nil;
+// A parameter the caller may leave out
+template <typename T>
+struct Optional {
+  T valueOr(const T& fallback) const {
+    return given ? value : fallback;
   }
-}
 
-inline 
-void packListItem(List* pList, std::string& s, Scope* pScope) {
-  if (pList && pList->get(0)) {
-    s = as<Str>(pList->get(0)->eval(pScope))->str;
-  } else {
-    s = "";
+  T    value;
+  bool given;
+};
+
+template <typename T>
+struct Unpack {
+};
+
+template <>
+struct Unpack<int> {
+  static int get(Expr* pValue) {
+    return as<Int>(pValue);
   }
-}
+};
 
-inline 
-void packListItem(List* pList, int& i, Scope* pScope) {
-  if (pList && pList->get(0)) {
-    i = as<Int>(pList->get(0)->eval(pScope))->num;
-  } else {
-    i = 0;
+template <>
+struct Unpack<float> {
+  static float get(Expr* pValue) {
+    return as<Float>(pValue);
   }
-}
+};
 
-inline 
-void packListItem(List* pList, float& i, Scope* pScope) {
-  if (pList && pList->get(0)) {
-    i = as<Float>(pList->get(0)->eval(pScope))->num;
-  } else {
-    i = 0;
+template <>
+struct Unpack<std::string> {
+  static const std::string& get(Expr* pValue) {
+    return as<Str>(pValue)->flat();
   }
-}
+};
 
-//------------------------------------------------------------------------------
+template <>
+struct Unpack<List*> {
+  static List* get(Expr* pValue) {
+    return as<List>(pValue);
+  }
+};
 
-template <int N, typename A, int M> 
-struct FillTupleWithList { 
-  typedef typename std::tuple_element<N, A>::type ElementN;
+template <>
+struct Unpack<Vector*> {
+  static Vector* get(Expr* pValue) {
+    return as<Vector>(pValue);
+  }
+};
 
-  inline static void 
-  fill (A& tuple, List* pList, Scope* pScope) {
-    packListItem(pList, std::get<N>(tuple), pScope);
-    FillTupleWithList<N+1, A, M>::fill(tuple, pList->pTail, pScope);
+// Any number
+template <>
+struct Unpack<double> {
+  static double get(Expr* pValue) {
+    if (Float::is(pValue)) {
+      return Float::unbox(pValue);
+    }
+    return as<Int>(pValue);
   }
 };
 
-template <typename A, int M> 
-struct FillTupleWithList<M, A, M> {
-  typedef typename std::tuple_element<M, A>::type ElementM;
+template <>
+struct Unpack<Array*> {
+  static Array* get(Expr* pValue) {
+    return as<Array>(pValue);
+  }
+};
 
-  inline static void 
-  fill (A& tuple, List* pList, Scope* pScope) {
-    packListItem(pList, std::get<M>(tuple), pScope);
+template <>
+struct Unpack<Dict*> {
+  static Dict* get(Expr* pValue) {
+    return as<Dict>(pValue);
   }
 };
 
-template <typename A>
-inline void 
-fillTupleWithList(A& a, List* pList, Scope* pScope) {
-  FillTupleWithList<
-    0, A, std::tuple_size<A>::value - 1
-  >::fill(a, pList, pScope);
-}
+template <>
+struct Unpack<Str*> {
+  static Str* get(Expr* pValue) {
+    return as<Str>(pValue);
+  }
+};
+
+template <>
+struct Unpack<Fun*> {
+  static Fun* get(Expr* pValue) {
+    return as<Fun>(pValue);
+  }
+};
+
+template <>
+struct Unpack<Expr*> {
+  static Expr* get(Expr* pValue) {
+    return pValue;
+  }
+};
+
+// The argument at index i, for a parameter of type S; the arity has been 
+// checked, so only an Optional or a Rest can find nothing there
+template <typename S>
+struct Argument {
+  typedef Unpack<typename std::decay<S>::type> U;
+
+  static auto get(Expr** ppArgs, size_t count, size_t i) 
+    -> decltype(U::get(0)) {
+    return U::get(ppArgs[i]);
+  }
+};
+
+template <typename T>
+struct Argument<Optional<T>> {
+  static Optional<T> get(Expr** ppArgs, size_t count, size_t i) {
+    Optional<T> optional = { T(), i < count };
+    if (optional.given) {
+      optional.value = Unpack<T>::get(ppArgs[i]);
+    }
+    return optional;
+  }
+};
+
+template <>
+struct Argument<Rest> {
+  static Rest get(Expr** ppArgs, size_t count, size_t i) {
+    Rest rest = { ppArgs + i, i < count ? count - i : 0 };
+    return rest;
+  }
+};
 
 //------------------------------------------------------------------------------
 
-template <typename...S>
-Fun* expose(void (*f)(S...)) {
-  return new Fun([=](List* pArgs, Scope* pScope) {
-    std::tuple<S...> t;
-    fillTupleWithList(t, pArgs, pScope);
-    corvid::apply(f, t);
+// Results are boxed by their type; bools are 1 or nil
+template <typename R>
+struct Box {
+  template <typename F, typename...A>
+  static Expr* call(F& f, A&&...a) {
+    return FromNative<R>::Type::box(f(std::forward<A>(a)...));
+  }
+};
+
+template <>
+struct Box<void> {
+  template <typename F, typename...A>
+  static Expr* call(F& f, A&&...a) {
+    f(std::forward<A>(a)...);
     return nil;
+  }
+};
+
+template <>
+struct Box<bool> {
+  template <typename F, typename...A>
+  static Expr* call(F& f, A&&...a) {
+    return f(std::forward<A>(a)...) ? Int::box(1) : nil;
+  }
+};
+
+// Heap values are already boxed
+template <typename T>
+struct Box<T*> {
+  template <typename F, typename...A>
+  static Expr* call(F& f, A&&...a) {
+    return f(std::forward<A>(a)...);
+  }
+};
+
+//------------------------------------------------------------------------------
+
+template <size_t...I> 
+struct Indices {
+};
+
+template <size_t N, size_t...I> 
+struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {
+};
+
+template <size_t...I> 
+struct MakeIndices<0, I...> {
+  typedef Indices<I...> Type;
+};
+
+template <typename S>
+struct IsOptional : std::false_type {
+};
+
+template <typename T>
+struct IsOptional<Optional<T>> : std::true_type {
+};
+
+template <typename...S>
+struct IsVariadic : std::false_type {
+};
+
+template <typename S>
+struct IsVariadic<S> : std::is_same<S, Rest> {
+};
+
+template <typename S, typename T, typename...U>
+struct IsVariadic<S, T, U...> : IsVariadic<T, U...> {
+};
+
+// How many arguments must be passed: all but an Optional or Rest tail
+template <typename...S>
+struct Required {
+  static const size_t value = 0;
+};
+
+template <typename S, typename...T>
+struct Required<S, T...> {
+  typedef typename std::decay<S>::type P;
+
+  static const size_t tail  = Required<T...>::value;
+  static const bool   given = tail > 0 || !(IsOptional<P>::value || 
+                                            std::is_same<P, Rest>::value);
+  static const size_t value = given ? tail + 1 : 0;
+};
+
+template <typename R, typename...S>
+struct Binding {
+  static const size_t arity    = sizeof...(S);
+  static const size_t required = Required<S...>::value;
+  static const bool   variadic = IsVariadic<S...>::value;
+
+  // The unpacking thunk is the native's only callable, so a call is one 
+  // indirect jump into it and f is called directly from there
+  template <typename F>
+  static Fun* bind(const F& f) {
+    return Fun::strict([=](Expr** ppArgs, size_t count) -> Expr* {
+      if (count < required) {
+        throw std::runtime_error("Too few arguments to native!");
+      }
+      if (count > arity && !variadic) {
+        throw std::runtime_error("Too many arguments to native!");
+      }
+      return call(f, ppArgs, count, typename MakeIndices<arity>::Type());
+    });
+  }
+
+  template <typename F, size_t...I>
+  static Expr* call(const F& f, Expr** ppArgs, size_t count, Indices<I...>) {
+    return Box<typename std::decay<R>::type>::call(
+      f, Argument<S>::get(ppArgs, count, I)...);
+  }
+};
+
+// The signature of a lambda's call operator
+template <typename M>
+struct CallOperator {
+};
+
+template <typename F, typename R, typename...S>
+struct CallOperator<R (F::*)(S...) const> {
+  typedef Binding<R, S...> Type;
+};
+
+template <typename F, typename R, typename...S>
+struct CallOperator<R (F::*)(S...)> {
+  typedef Binding<R, S...> Type;
+};
+
+template <typename R, typename...S>
+Fun* Fun::native(R (*f)(S...)) {
+  return Binding<R, S...>::bind(f);
+}
+
+template <typename F>
+Fun* Fun::native(const F& f) {
+  return CallOperator<decltype(&F::operator())>::Type::bind(f);
+}
+
+template <typename R, typename C, typename...S>
+Fun* Fun::native(R (C::*f)(S...)) {
+  return Binding<R, C*, S...>::bind([=](C* pSelf, S...s) -> R {
+    return (pSelf->*f)(s...);
   });
 }
 
-template <typename R, typename...S>
-Fun* expose(R (*f)(S...)) {
-  return new Fun([=](List* pArgs, Scope* pScope) {
-    std::tuple<S...> t;
-    fillTupleWithList(t, pArgs, pScope);
-    return new typename FromNative<R>::Type(corvid::apply(f, t));
+template <typename R, typename C, typename...S>
+Fun* Fun::native(R (C::*f)(S...) const) {
+  return Binding<R, C*, S...>::bind([=](C* pSelf, S...s) -> R {
+    return (pSelf->*f)(s...);
   });
 }
 
+//------------------------------------------------------------------------------
+
+template <typename F>
+Fun* expose(const F& f) {
+  return Fun::native(f);
+}
+
 }
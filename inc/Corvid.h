@@ -27,6 +27,9 @@
 
 #include <Utilities.h>
 #include <Parsing.h>
+#include <Gc.h>
+#include <Metrics.h>
+#include <Simd.h>
 
 #include <iostream>
 #include <iomanip>
@@ -36,6 +39,11 @@
 #include <list>
 #include <memory>
 #include <stdexcept>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <unordered_map>
 
 #include <sstream>
 
@@ -106,50 +114,275 @@ struct Lexer {
 
 
 struct Scope;
-  
-struct Atom;
-struct List;
+
+//------------------------------------------------------------------------------
+// Values
+//
+// An Expr* is a tagged word rather than a plain pointer.  Heap expressions are
+// always at least 8-byte aligned, which leaves the low three bits free to mark
+// immediates that carry their payload in the upper 32 bits of the word:
+//
+//   ...000  pointer to a heap Expr (List, Str, Fun)
+//   ...001  Int
+//   ...010  Float
+//   ...011  Sym, interned id
+//   ...100  Local, lexical address of a lambda variable (depth:16, slot:16)
+//
+// Immediates must never be dereferenced, so code that may be handed an
+// arbitrary value goes through evalExpr/printExpr/typeOf and the is/box/unbox
+// helpers on each type instead of calling through the pointer.
+static_assert(sizeof(void*) == 8, "tagged values require 64-bit pointers");
+
+enum ValueTag {
+  HEAP_TAG  = 0,
+  INT_TAG   = 1,
+  FLOAT_TAG = 2,
+  SYM_TAG   = 3,
+  LOCAL_TAG = 4,
+};
+
+const uintptr_t tagMask = 0x7;
+
 // An expression is an Atom or a List
-struct Expr {
-  Expr()         : pAtom(0), pList(0) {}
-  Expr(Atom* p)  : pAtom(p), pList(0) {}
-  Expr(List* p)  : pAtom(0), pList(p) {}
+struct Expr : public Cell {
+  enum Type {
+    LIST,
+    SYM,
+    STR,
+    FUN,
+    LAMBDA,
+    INT,
+    FLOAT,
+    LOCAL,
+    VECTOR,
+    CALL,
+    ARRAY,
+    DICT,
+    PVEC,
+    TRANSIENT,
+    FUTURE,
+    TASK,
+    CHAN,
+    FOLDED,
+    TAIL_CALL,
+    TYPES,    // Not a type: how many there are
+  };
+
+  Expr(Type t) : type(t) {
+    metrics().allocs[t].bump();
+  }
 
-  Atom* pAtom;
-  List* pList;
+  ~Expr() {
+    metrics().frees[type].bump();
+  }
+
+  Type type;
 
   // Expressions are abstract
   virtual void  print ()              = 0;
   virtual Expr* eval  (Scope* pScope) = 0;
 };
 
-struct Sym;
-struct Int;
-struct Float;
-struct Str;
-struct Fun;
+inline uintptr_t tagOf(const Expr* pExpr) {
+  return reinterpret_cast<uintptr_t>(pExpr) & tagMask;
+}
+
+inline bool isHeap(const Expr* pExpr) {
+  return pExpr && tagOf(pExpr) == HEAP_TAG;
+}
+
+inline Expr* immediate(uint32_t bits, ValueTag tag) {
+  return reinterpret_cast<Expr*>((static_cast<uintptr_t>(bits) << 32) | tag);
+}
+
+inline uint32_t payload(const Expr* pExpr) {
+  return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(pExpr) >> 32);
+}
+
+// Immediates are not cells, so they are skipped when marking and rooting
+inline void markExpr(Gc& gc, Expr* pExpr) {
+  if (isHeap(pExpr)) {
+    gc.mark(pExpr);
+  }
+}
+
+inline Expr* rootExpr(Expr* pExpr) {
+  if (isHeap(pExpr)) {
+    gc.root(pExpr);
+  }
+  return pExpr;
+}
+
+inline const char* typeName(Expr::Type type) {
+  static const char* names[] = {
+    "list", "sym", "str", "fun", "lambda", "int", "float", "local", "vector", 
+    "call", "array", "dict", "pvec", "transient", "future", "task", "chan",
+    "folded", "tail-call",
+  };
+  static_assert(sizeof(names) / sizeof(names[0]) == Expr::TYPES, 
+                "Every type needs a name!");
+  static_assert(Expr::TYPES <= Metrics::maxTypes, "Too many types to count!");
+  return names[type];
+}
+
+inline Expr::Type typeOf(const Expr* pExpr) {
+  switch (tagOf(pExpr)) {
+    case INT_TAG:   return Expr::INT;
+    case FLOAT_TAG: return Expr::FLOAT;
+    case SYM_TAG:   return Expr::SYM;
+    case LOCAL_TAG: return Expr::LOCAL;
+    default:        return pExpr->type;
+  }
+}
+
+// Every type error goes through here so that they can be counted
+[[noreturn]] inline void typeError(const char* message) {
+  metrics().typeErrors.bump();
+  throw std::runtime_error(message);
+}
+
+// Immediates evaluate to themselves, except symbols which are looked up
+Expr* evalExpr(Expr* pExpr, Scope* pScope);
+void  printExpr(Expr* pExpr);
+
+struct Int {
+  static bool is(const Expr* pExpr) { 
+    return tagOf(pExpr) == INT_TAG; 
+  }
+
+  static Expr* box(int num) { 
+    return immediate(static_cast<uint32_t>(num), INT_TAG); 
+  }
+
+  static int unbox(const Expr* pExpr) { 
+    return static_cast<int32_t>(payload(pExpr)); 
+  }
+};
+
+struct Float {
+  static bool is(const Expr* pExpr) { 
+    return tagOf(pExpr) == FLOAT_TAG; 
+  }
+
+  static Expr* box(float num) { 
+    uint32_t bits;
+    memcpy(&bits, &num, sizeof(bits));
+    return immediate(bits, FLOAT_TAG);
+  }
+
+  static float unbox(const Expr* pExpr) { 
+    uint32_t bits = payload(pExpr);
+    float    num;
+    memcpy(&num, &bits, sizeof(num));
+    return num;
+  }
+};
+
+//------------------------------------------------------------------------------
+// Symbols are interned once, when they are read, and are compared and looked
+// up by id from then on
+typedef uint32_t SymId;
+
+struct Symbols {
+  // Futures may intern and name symbols while the main thread reads a form
+  SymId intern(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = ids_.find(name);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+
+    SymId id = names_.size();
+    names_.push_back(name);
+    ids_[name] = id;
+    return id;
+  }
+
+  // Names never move once interned, so the reference outlives the lock
+  const std::string& name(SymId id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return names_[id];
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return names_.size();
+  }
+
+  std::unordered_map<std::string, SymId> ids_;
+  std::deque<std::string>                names_;
+  mutable std::mutex                     mutex_;
+};
+
+Symbols symbols;
+
+struct Sym {
+  static bool is(const Expr* pExpr) { 
+    return tagOf(pExpr) == SYM_TAG; 
+  }
+
+  static Expr* box(SymId id) { 
+    return immediate(id, SYM_TAG); 
+  }
+
+  static SymId unbox(const Expr* pExpr) { 
+    return payload(pExpr); 
+  }
+
+  static Expr* intern(const std::string& name) {
+    return box(symbols.intern(name));
+  }
+
+  static const std::string& name(const Expr* pExpr) {
+    return symbols.name(unbox(pExpr));
+  }
+};
+
+// A reference to a variable bound by an enclosing lambda, resolved ahead of
+// time to the number of frames to walk up and a slot within that frame
+struct Local {
+  static bool is(const Expr* pExpr) { 
+    return tagOf(pExpr) == LOCAL_TAG; 
+  }
+
+  static Expr* box(uint32_t depth, uint32_t slot) { 
+    return immediate((depth << 16) | slot, LOCAL_TAG); 
+  }
+
+  static uint32_t depth(const Expr* pExpr) { 
+    return payload(pExpr) >> 16; 
+  }
+
+  static uint32_t slot(const Expr* pExpr) { 
+    return payload(pExpr) & 0xffff; 
+  }
+};
+
 // An atom is a symbol, int, float, string or function
 struct Atom : public Expr {
-  Atom()         : Expr(this), pSym(0), pInt(0), pFloat(0), pStr(0), pFun(0) {} 
-  Atom(Sym* p)   : Expr(this), pSym(p), pInt(0), pFloat(0), pStr(0), pFun(0) {} 
-  Atom(Int* p)   : Expr(this), pSym(0), pInt(p), pFloat(0), pStr(0), pFun(0) {} 
-  Atom(Float* p) : Expr(this), pSym(0), pInt(0), pFloat(p), pStr(0), pFun(0) {} 
-  Atom(Str* p)   : Expr(this), pSym(0), pInt(0), pFloat(0), pStr(p), pFun(0) {} 
-  Atom(Fun* p)   : Expr(this), pSym(0), pInt(0), pFloat(0), pStr(0), pFun(p) {} 
-
-  Sym*   pSym;
-  Int*   pInt;
-  Float* pFloat;
-  Str*   pStr;
-  Fun*   pFun;
+  Atom(Type t) : Expr(t) {}
 
   // Also abstract
 };
 
+struct List;
 List *nil;
 struct List : public Expr {
-  List()                  : Expr(this), pHead(0), pTail(0) {}
-  List(Expr* p, List* q) : Expr(this), pHead(p), pTail(q) {}
+  List()                  : Expr(LIST), pHead(0), pTail(0) {}
+  List(Expr* p, List* q) : Expr(LIST), pHead(p), pTail(q) {}
+
+  static bool is(const Expr* pExpr) {
+    return isHeap(pExpr) && pExpr->type == LIST;
+  }
+
+  static Expr* box(List* pList) {
+    return pList;
+  }
+
+  void trace(Gc& gc) {
+    markExpr(gc, pHead);
+    gc.mark(pTail);
+  }
 
   void print() {
     if (!pHead && !pTail) {
@@ -158,7 +391,7 @@ struct List : public Expr {
     }
 
     std::cout << "( ";
-    if (pHead) pHead->print();
+    if (pHead) printExpr(pHead);
     std::cout <<  " . ";
     if (pTail) pTail->print();
     std::cout <<  " )";
@@ -182,20 +415,21 @@ struct List : public Expr {
     }
   }
 
+  // Items past the end of the list are nil
   Expr* get(size_t index) const {
-    if (index == 0) {
-      return pHead;
-    } else {
-      return pTail->get(index - 1);
+    auto pList = this;
+    for (; pList && index; index--) {
+      pList = pList->pTail;
     }
+    return (pList && pList->pHead) ? pList->pHead : nil;
   }
 
   size_t length() const {
-    if (!pTail) {
-      return 0;
-    } else {
-      return pTail->length() + 1;
+    size_t n = 0;
+    for (auto pList = this; pList->pTail; pList = pList->pTail) {
+      n++;
     }
+    return n;
   }
 
   void append(Expr* pExpr) {
@@ -220,90 +454,750 @@ struct List : public Expr {
 };
 
 
-struct Scope {
-  Scope(Scope* pParentScope = 0) : pParentScope_(pParentScope) {}
-  
-  Expr* getValue(const std::string& symbol) const {
-   auto it = symbols_.find(symbol);
-    if (it == symbols_.end()) {
-      if (pParentScope_) {
-        return pParentScope_->getValue(symbol);
-      } else {
-        return getValue("nil");
+// Whether calls to it with constant arguments can be done ahead of time
+inline bool isPure(const Expr* pExpr);
+
+// Scopes bind interned symbol ids to values.  A lambda's activation frame is 
+// a scope whose variables live in a flat array of slots instead, addressed by 
+// Local references.
+struct Scope : public Cell {
+  Scope(Scope* pParentScope = 0, size_t slots = 0) 
+  : slots_(slots, nil)
+  , pParentScope_(pParentScope)
+  , escaped_(false) {
+    metrics().scopes.bump();
+  }
+
+  ~Scope() {
+    metrics().freedScopes.bump();
+  }
+
+  void trace(Gc& gc) {
+    gc.mark(pParentScope_);
+    for (auto& symbol : symbols_) {
+      markExpr(gc, symbol.second);
+    }
+    for (auto pSlot : slots_) {
+      markExpr(gc, pSlot);
+    }
+  }
+
+  // Unbound symbols evaluate to nil
+  Expr* getValue(SymId symbol) const {
+    size_t depth = 0;
+    for (auto pScope = this; pScope; pScope = pScope->pParentScope_, depth++) {
+      if (pScope->symbols_.empty()) {
+        continue;
+      }
+
+      auto it = pScope->symbols_.find(symbol);
+      if (it != pScope->symbols_.end()) {
+        metrics().lookupDepth.observe(depth);
+        return it->second;
       }
     }
 
-    return it->second;
+    metrics().lookupDepth.observe(depth);
+    return nil;
   }
 
-  void setValue(const std::string& symbol, Expr* pValue) {
+  Expr*& getSlot(const Expr* pLocal) {
+    auto pScope = this;
+    for (auto depth = Local::depth(pLocal); depth; depth--) {
+      pScope = pScope->pParentScope_;
+    }
+    return pScope->slots_[Local::slot(pLocal)];
+  }
+
+  // Rebind a variable wherever it is bound, or bind it here
+  void assign(SymId symbol, Expr* pValue) {
+    for (auto pScope = this; pScope; pScope = pScope->pParentScope_) {
+      auto it = pScope->symbols_.find(symbol);
+      if (it != pScope->symbols_.end()) {
+        pScope->checkWritable();
+        it->second = pValue;
+        return;
+      }
+    }
+
+    setValue(symbol, pValue);
+  }
+
+  void setValue(SymId symbol, Expr* pValue) {
+    checkWritable();
+    if (pParentScope_) {
+      shadowEpoch++;
+    }
     symbols_[symbol] = pValue;
   }
 
-  Scope* extend() {
-    return new Scope(this);
+  // The global scope is shared, unlocked, by every thread of a parallel 
+  // section or future, so there it can only be read, and the main thread
+  // waits for any futures still running before it writes
+  void checkWritable() {
+    if (pParentScope_) {
+      return;
+    }
+    if (gc.isWorker()) {
+      throw std::runtime_error("Globals are read-only in parallel code!");
+    }
+    gc.settle();
+  }
+
+  // The address of a binding in the outermost scope, or 0 if it is unbound 
+  // or shadowed.  Bindings are never removed, so the address stays valid
+  // until something is bound in an inner scope, which bumps shadowEpoch.
+  Expr** findGlobal(SymId symbol) {
+    auto pScope = this;
+    for (; pScope->pParentScope_; pScope = pScope->pParentScope_) {
+      if (!pScope->symbols_.empty() && pScope->symbols_.count(symbol)) {
+        return 0;
+      }
+    }
+
+    auto it = pScope->symbols_.find(symbol);
+    if (it == pScope->symbols_.end()) {
+      return 0;
+    }
+    return &it->second;
+  }
+
+  void setValue(const std::string& symbol, Expr* pValue) {
+    setValue(symbols.intern(symbol), pValue);
+  }
+
+  // A scope nested in this one, from the frame pool if it has one to spare
+  Scope* extend(size_t slots = 0);
+
+  // The call this frame was made for has returned
+  void release();
+
+  // A copy of this scope and every scope it is nested in, for code that runs
+  // on another thread while this one carries on changing the originals
+  Scope* snapshot() const {
+    auto pCopy = new Scope(pParentScope_ ? pParentScope_->snapshot() : 0);
+    pCopy->symbols_ = symbols_;
+    pCopy->slots_   = slots_;
+    return pCopy;
+  }
+
+  // A closure now refers to this scope, so neither it nor anything it is 
+  // nested in can be recycled for a tail call
+  void escape() {
+    for (auto pScope = this; pScope && !pScope->escaped_; 
+         pScope = pScope->pParentScope_) {
+      pScope->escaped_ = true;
+    }
+  }
+
+  // Rebinds a frame for another call to a lambda with the same parent scope
+  bool recyclable(Scope* pParent, size_t slots) const {
+    return !escaped_ && pParentScope_ == pParent && slots_.size() == slots;
   }
 
-  std::map<std::string, Expr*> symbols_;
-  Scope*                        pParentScope_;
+  std::unordered_map<SymId, Expr*> symbols_;
+  std::vector<Expr*>               slots_;
+  Scope*                           pParentScope_;
+  bool                             escaped_;
+
+  // Bumped by any thread binding a local
+  static std::atomic<size_t>       shadowEpoch;
 };
 
-struct Sym : public Atom {
-  Sym(ParseNode* pNode) : Atom(this), sym(pNode->match) {} 
+std::atomic<size_t> Scope::shadowEpoch(0);
+
+// Activation frames that no closure has captured go back to a pool of their
+// thread's when their call returns, and later calls reuse them instead of 
+// allocating.  Calls nest, so the pool works like a stack: recursion to 
+// depth n needs n frames, and then no more (up to maxFrames, past which the
+// collector has them).  A pooled frame is emptied, so that it holds on to 
+// nothing, and marked, so that it is not collected.
+struct FramePool {
+  static const size_t maxFrames = 1024;
+
+  FramePool() {
+    roots_ = gc.addRoots([this](Gc& gc) {
+      for (auto pFrame : frames_) {
+        gc.mark(pFrame);
+      }
+    });
+  }
 
-  void print() {
-    std::cout << sym;
+  // The thread is exiting; its frames are garbage
+  ~FramePool() {
+    gc.removeRoots(roots_);
+  }
+
+  Scope* acquire(Scope* pParent, size_t slots) {
+    if (frames_.empty()) {
+      return new Scope(pParent, slots);
+    }
+
+    auto pFrame = frames_.back();
+    frames_.pop_back();
+    pFrame->pParentScope_ = pParent;
+    pFrame->slots_.resize(slots, nil);
+    return pFrame;
+  }
+
+  void release(Scope* pFrame) {
+    if (frames_.size() == maxFrames) {
+      return;
+    }
+
+    std::fill(pFrame->slots_.begin(), pFrame->slots_.end(), nil);
+    if (!pFrame->symbols_.empty()) {
+      pFrame->symbols_.clear();
+    }
+    pFrame->pParentScope_ = 0;
+    frames_.push_back(pFrame);
+  }
+
+  std::vector<Scope*> frames_;
+  Gc::RootsId         roots_;
+};
+
+thread_local FramePool framePool;
+
+inline Scope* Scope::extend(size_t slots) {
+  return framePool.acquire(this, slots);
+}
+
+inline void Scope::release() {
+  if (!escaped_) {
+    framePool.release(this);
+  }
+}
+
+// Releases a frame when the C++ frame that made it is done with it
+struct FrameScope {
+  explicit FrameScope(Scope* pFrame = 0) : pFrame_(pFrame) {}
+  ~FrameScope() { 
+    if (pFrame_) {
+      pFrame_->release();
+    }
+  }
+
+  Scope* pFrame_;
+};
+
+inline Expr* evalExpr(Expr* pExpr, Scope* pScope) {
+  switch (tagOf(pExpr)) {
+    case HEAP_TAG:  return pExpr->eval(pScope);
+    case SYM_TAG:   return pScope->getValue(Sym::unbox(pExpr));
+    case LOCAL_TAG: return pScope->getSlot(pExpr);
+    default:        return pExpr;
+  }
+}
+
+// Strings are ropes.  A leaf is a slice of an immutable text that other 
+// strings may share, so substrings copy nothing; a node is the concatenation 
+// of two strings, so joining copies nothing either.  Concatenation keeps the
+// rope balanced, so it and slicing are O(log n).  
+// Natives that want a std::string get one from flat(), which collapses the
+// string to a single leaf the first time.
+struct Str : public Atom {
+  typedef std::shared_ptr<const std::string> Text;
+
+  Str(const std::string& m = "") 
+  : Atom(STR) {
+    leaf(std::make_shared<const std::string>(m), 0, m.size());
+  } 
+
+  // A literal is a slice of the source it was read from, less its quotes
+  Str(const Text& source, ParseNode* pNode) 
+  : Atom(STR) {
+    auto& match = pNode->match;
+    leaf(source, &*match.begin() - source->data() + 1, match.size() - 2);
+  } 
+
+  Str(const Text& t, size_t offset, size_t length) 
+  : Atom(STR) {
+    leaf(t, offset, length);
+  }
+
+  Str(Str* pL, Str* pR) 
+  : Atom(STR)
+  , offset(0)
+  , length(pL->length + pR->length)
+  , pLeft(pL)
+  , pRight(pR)
+  , depth(std::max(pL->depth, pR->depth) + 1) {
+  }
+
+  static bool is(const Expr* pExpr) {
+    return isHeap(pExpr) && pExpr->type == STR;
+  }
+
+  static Expr* box(const std::string& str) {
+    return new Str(str);
+  }
+
+  void trace(Gc& gc) {
+    gc.mark(pLeft);
+    gc.mark(pRight);
+  }
+
+  void print() { 
+    if (pLeft) {
+      pLeft->print();
+      pRight->print();
+    } else {
+      std::cout.write(text->data() + offset, length);
+    }
   }
 
   Expr* eval (Scope* pScope) {
-    return pScope->getValue(sym);
+    return this;
+  }
+
+  size_t size() const {
+    return length;
+  }
+
+  // Other threads may be reading this string during a parallel section or 
+  // while a future runs, so then it is flattened into a scratch copy instead,
+  // which lives until the task (or on the main thread the REPL line) ends
+  const std::string& flat() {
+    if (pLeft || offset || length != text->size()) {
+      std::string str;
+      str.reserve(length);
+      appendTo(str);
+      if (gc.isShared()) {
+        scratch().push_back(std::move(str));
+        return scratch().back();
+      }
+      leaf(std::make_shared<const std::string>(std::move(str)), 0, length);
+    }
+    return *text;
+  }
+
+  static std::deque<std::string>& scratch() {
+    static thread_local std::deque<std::string> strings;
+    return strings;
+  }
+
+  void appendTo(std::string& str) const {
+    if (pLeft) {
+      pLeft->appendTo(str);
+      pRight->appendTo(str);
+    } else {
+      str.append(*text, offset, length);
+    }
+  }
+
+  static Str* cat(Str* pA, Str* pB) {
+    if (!pA->length) {
+      return pB;
+    }
+    if (!pB->length) {
+      return pA;
+    }
+
+    // Short strings are cheaper copied than linked
+    if (pA->length + pB->length <= shortLength) {
+      std::string str;
+      pA->appendTo(str);
+      pB->appendTo(str);
+      return new Str(str);
+    }
+
+    auto pStr = join(pA, pB);
+    return pStr->depth > maxDepth ? pStr->rebalance() : pStr;
+  }
+
+  Str* substr(size_t start, size_t count) {
+    if (start > length) {
+      throw std::runtime_error("Index out of range!");
+    }
+    count = std::min(count, length - start);
+    if (start == 0 && count == length) {
+      return this;
+    }
+
+    if (!pLeft) {
+      return new Str(text, offset + start, count);
+    }
+
+    auto split = pLeft->length;
+    if (start + count <= split) {
+      return pLeft->substr(start, count);
+    }
+    if (start >= split) {
+      return pRight->substr(start - split, count);
+    }
+    return cat(pLeft->substr(start, split - start), 
+               pRight->substr(0, start + count - split));
+  }
+
+  static const size_t shortLength = 32;
+  static const size_t maxDepth    = 48;
+
+  Text   text;
+  size_t offset;
+  size_t length;
+  Str*   pLeft;
+  Str*   pRight;
+  size_t depth;
+
+private:
+  void leaf(const Text& t, size_t o, size_t l) {
+    text   = t;
+    offset = o;
+    length = l;
+    pLeft  = pRight = 0;
+    depth  = 0;
+  }
+
+  // Concatenation keeps the rope height balanced like an AVL tree, joining
+  // the shallower rope onto the spine of the deeper one and rotating
+  static Str* join(Str* pA, Str* pB) {
+    if (pA->depth > pB->depth + 1) {
+      return joinRight(pA, pB);
+    }
+    if (pB->depth > pA->depth + 1) {
+      return joinLeft(pA, pB);
+    }
+    return new Str(pA, pB);
+  }
+
+  static Str* joinRight(Str* pA, Str* pB) {
+    auto pL = pA->pLeft;
+    auto pC = pA->pRight;
+    if (pC->depth <= pB->depth + 1) {
+      auto pT = new Str(pC, pB);
+      if (pT->depth <= pL->depth + 1) {
+        return new Str(pL, pT);
+      }
+      return rotateLeft(new Str(pL, rotateRight(pT)));
+    }
+
+    auto pT = joinRight(pC, pB);
+    auto pN = new Str(pL, pT);
+    return pT->depth <= pL->depth + 1 ? pN : rotateLeft(pN);
   }
 
-  std::string sym; 
+  static Str* joinLeft(Str* pA, Str* pB) {
+    auto pC = pB->pLeft;
+    auto pR = pB->pRight;
+    if (pC->depth <= pA->depth + 1) {
+      auto pT = new Str(pA, pC);
+      if (pT->depth <= pR->depth + 1) {
+        return new Str(pT, pR);
+      }
+      return rotateRight(new Str(rotateLeft(pT), pR));
+    }
+
+    auto pT = joinLeft(pA, pC);
+    auto pN = new Str(pT, pR);
+    return pT->depth <= pR->depth + 1 ? pN : rotateRight(pN);
+  }
+
+  // (x (y z)) to ((x y) z)
+  static Str* rotateLeft(Str* pStr) {
+    auto pRight = pStr->pRight;
+    return new Str(new Str(pStr->pLeft, pRight->pLeft), pRight->pRight);
+  }
+
+  // ((x y) z) to (x (y z))
+  static Str* rotateRight(Str* pStr) {
+    auto pLeft = pStr->pLeft;
+    return new Str(pLeft->pLeft, new Str(pLeft->pRight, pStr->pRight));
+  }
+
+  void leaves(std::vector<Str*>& out) {
+    if (pLeft) {
+      pLeft->leaves(out);
+      pRight->leaves(out);
+    } else {
+      out.push_back(this);
+    }
+  }
+
+  static Str* balanced(std::vector<Str*>& leaves, size_t begin, size_t end) {
+    if (end - begin == 1) {
+      return leaves[begin];
+    }
+    auto middle = begin + (end - begin) / 2;
+    return new Str(balanced(leaves, begin, middle), 
+                   balanced(leaves, middle, end));
+  }
+
+  Str* rebalance() {
+    std::vector<Str*> all;
+    leaves(all);
+    return balanced(all, 0, all.size());
+  }
 };
 
+// A growable array of values with constant time indexing
+struct Vector : public Atom {
+  Vector() : Atom(VECTOR) {}
+  Vector(Expr** ppItems, size_t count) 
+  : Atom(VECTOR)
+  , items(ppItems, ppItems + count) {
+  } 
 
-struct Float : public Atom {
-  Float(ParseNode* pNode) : Atom(this), num(atof(pNode->match.c_str())) {} 
-  Float(float num) : Atom(this), num(num) {} 
+  static bool is(const Expr* pExpr) {
+    return isHeap(pExpr) && pExpr->type == VECTOR;
+  }
 
-  void print() { std::cout << num; }
+  static Expr* box(Vector* pVector) {
+    return pVector;
+  }
+
+  void trace(Gc& gc) {
+    for (auto pItem : items) {
+      markExpr(gc, pItem);
+    }
+  }
+
+  void print();
 
   Expr* eval (Scope* pScope) {
     return this;
   }
 
-  float num;
+  Expr*& at(int index) {
+    if (index < 0 || size_t(index) >= items.size()) {
+      throw std::runtime_error("Index out of range!");
+    }
+    return items[index];
+  }
+
+  std::vector<Expr*> items;
 };
 
-struct Int : public Atom {
-  Int(ParseNode* pNode) : Atom(this), num(atoi(pNode->match.c_str())) {} 
-  Int(int num) : Atom(this), num(num) {} 
+// A packed array of numbers of a single element type, which the SIMD 
+// builtins work on.  Elements read out of f64 and i64 arrays are narrowed to
+// the 32 bit Float and Int.
+struct Array : public Atom {
+  Array(ArrayElem e, size_t n) 
+  : Atom(ARRAY)
+  , elem(e)
+  , size(n)
+  , bytes(n * elemSize(e))
+  , pData(0) {
+    // Aligned for the widest vectors, and never empty
+    if (posix_memalign(&pData, 32, bytes ? bytes : 32)) {
+      throw std::bad_alloc();
+    }
+    memset(pData, 0, bytes);
+    gc.accountAlloc(bytes);
+  }
+
+  ~Array() {
+    free(pData);
+    gc.accountFree(bytes);
+  }
+
+  static bool is(const Expr* pExpr) {
+    return isHeap(pExpr) && pExpr->type == ARRAY;
+  }
+
+  static Expr* box(Array* pArray) {
+    return pArray;
+  }
 
-  void print() { std::cout << num; }
+  void print();
 
   Expr* eval (Scope* pScope) {
     return this;
   }
 
-  int num;
+  void check(size_t index) const {
+    if (index >= size) {
+      throw std::runtime_error("Index out of range!");
+    }
+  }
+
+  Expr* get(size_t index) const {
+    check(index);
+    switch (elem) {
+      case F32: return Float::box(static_cast<float*>  (pData)[index]);
+      case F64: return Float::box(static_cast<double*> (pData)[index]);
+      case I32: return Int::box  (static_cast<int32_t*>(pData)[index]);
+      case I64: return Int::box  (static_cast<int64_t*>(pData)[index]);
+    }
+    return 0;
+  }
+
+  void set(size_t index, double value) {
+    check(index);
+    switch (elem) {
+      case F32: static_cast<float*>  (pData)[index] = value; break;
+      case F64: static_cast<double*> (pData)[index] = value; break;
+      case I32: static_cast<int32_t*>(pData)[index] = value; break;
+      case I64: static_cast<int64_t*>(pData)[index] = value; break;
+    }
+  }
+
+  ArrayElem elem;
+  size_t    size;
+  size_t    bytes;
+  void*     pData;
 };
 
-struct Str : public Atom {
-  Str(const std::string& m = "") : Atom(this), str(m) {} 
-  Str(ParseNode* pNode) : Atom(this), str(pNode->match.begin()+1, pNode->match.end()-1) {} 
+// A hash table from strings, symbols or ints to values.  It is open 
+// addressed with linear probing over a power of two table kept under three
+// quarters full, so a lookup is a hash and usually one or two probes.
+struct Dict : public Atom {
+  struct Slot {
+    Expr*  pKey;
+    Expr*  pValue;
+    size_t hash;
+  };
+
+  Dict() 
+  : Atom(DICT)
+  , slots(8)
+  , count(0) {
+  } 
+
+  static bool is(const Expr* pExpr) {
+    return isHeap(pExpr) && pExpr->type == DICT;
+  }
+
+  void trace(Gc& gc) {
+    for (auto& slot : slots) {
+      markExpr(gc, slot.pKey);
+      markExpr(gc, slot.pValue);
+    }
+  }
 
-  void print() { std::cout << str; }
+  void print();
 
   Expr* eval (Scope* pScope) {
     return this;
   }
 
-  std::string str; 
+  // Empty slots have no key
+  Slot* find(Expr* pKey) {
+    pKey = checkKey(pKey);
+    auto hash = hashKey(pKey);
+    auto mask = slots.size() - 1;
+    for (auto i = hash & mask; ; i = (i + 1) & mask) {
+      auto& slot = slots[i];
+      if (!slot.pKey || (slot.hash == hash && sameKey(slot.pKey, pKey))) {
+        return &slot;
+      }
+    }
+  }
+
+  Expr* get(Expr* pKey) {
+    auto pSlot = find(pKey);
+    return pSlot->pKey ? pSlot->pValue : 0;
+  }
+
+  void set(Expr* pKey, Expr* pValue) {
+    if ((count + 1) * 4 > slots.size() * 3) {
+      grow();
+    }
+
+    auto pSlot = find(pKey);
+    if (!pSlot->pKey) {
+      pSlot->pKey = checkKey(pKey);
+      pSlot->hash = hashKey(pSlot->pKey);
+      count++;
+    }
+    pSlot->pValue = pValue;
+  }
+
+  std::vector<Slot> slots;
+  size_t            count;
+
+private:
+  // Integral floats, which is how numeric literals are read, key as ints;
+  // any other float is rejected rather than aliasing the int it truncates to
+  static Expr* checkKey(Expr* pKey) {
+    if (Float::is(pKey)) {
+      auto num = Float::unbox(pKey);
+      if (num >= -2147483648.0f && num < 2147483648.0f && 
+          num == static_cast<int>(num)) {
+        return Int::box(static_cast<int>(num));
+      }
+    }
+    if (Int::is(pKey) || Sym::is(pKey) || Str::is(pKey)) {
+      return pKey;
+    }
+    typeError("Type error: dict keys are strings, symbols or ints!");
+  }
+
+  static size_t hashKey(Expr* pKey) {
+    if (Str::is(pKey)) {
+      return std::hash<std::string>()(static_cast<Str*>(pKey)->flat());
+    }
+
+    // Mix the tag and payload so consecutive ints spread out
+    uint64_t word = reinterpret_cast<uintptr_t>(pKey);
+    word ^= word >> 33;
+    word *= 0xff51afd7ed558ccdULL;
+    word ^= word >> 33;
+    return word;
+  }
+
+  static bool sameKey(Expr* pA, Expr* pB) {
+    if (pA == pB) {
+      return true;
+    }
+    return Str::is(pA) && Str::is(pB) && 
+      static_cast<Str*>(pA)->flat() == static_cast<Str*>(pB)->flat();
+  }
+
+  void grow() {
+    std::vector<Slot> old(slots.size() * 2);
+    old.swap(slots);
+    count = 0;
+    for (auto& slot : old) {
+      if (slot.pKey) {
+        set(slot.pKey, slot.pValue);
+      }
+    }
+  }
 };
 
-template <typename A>
-void fillTupleWithList(A& a, List* pList, Scope* pScope);
+inline void printExpr(Expr* pExpr) {
+  switch (tagOf(pExpr)) {
+    case INT_TAG:   std::cout << Int::unbox(pExpr);   break;
+    case FLOAT_TAG: std::cout << Float::unbox(pExpr); break;
+    case SYM_TAG:   std::cout << Sym::name(pExpr);    break;
+    case LOCAL_TAG: std::cout << "<local " << Local::depth(pExpr) 
+                              << "." << Local::slot(pExpr) << ">"; break;
+    default:        pExpr->print();                   break;
+  }
+}
+
+inline void Vector::print() {
+  std::cout << "[ ";
+  for (auto pItem : items) {
+    printExpr(pItem);
+    std::cout << " ";
+  }
+  std::cout << "]";
+}
+
+inline void Dict::print() {
+  std::cout << "{ ";
+  for (auto& slot : slots) {
+    if (slot.pKey) {
+      printExpr(slot.pKey);
+      std::cout << " ";
+      printExpr(slot.pValue);
+      std::cout << " ";
+    }
+  }
+  std::cout << "}";
+}
+
+inline void Array::print() {
+  static const char* names[] = { "f32", "f64", "i32", "i64" };
+  std::cout << names[elem] << "[ ";
+  for (size_t i = 0; i < size; i++) {
+    printExpr(get(i));
+    std::cout << " ";
+  }
+  std::cout << "]";
+}
 
 template<typename N>
 struct FromNative {
@@ -334,42 +1228,133 @@ struct FromNative<List*> {
   typedef List Type;
 };
 
+template<>
+struct FromNative<Vector*> {
+  typedef Vector Type;
+};
+
+// Evaluates an argument list left to right, rooting each value in the 
+// caller's RootScope
+struct Arguments {
+  Arguments(List* pArgs, Scope* pScope) : count_(0) {
+    for (; pArgs && pArgs->pHead; pArgs = pArgs->pTail) {
+      push(rootExpr(evalExpr(pArgs->pHead, pScope)));
+    }
+  }
+
+  void push(Expr* pExpr) {
+    if (count_ < inlineCount) {
+      inline_[count_++] = pExpr;
+      return;
+    }
+
+    if (overflow_.empty()) {
+      overflow_.assign(inline_, inline_ + inlineCount);
+    }
+    overflow_.push_back(pExpr);
+    count_++;
+  }
+
+  Expr** data() { 
+    return overflow_.empty() ? inline_ : overflow_.data(); 
+  }
+
+  size_t size() const { 
+    return count_; 
+  }
+
+  static const size_t inlineCount = 8;
+
+  Expr*              inline_[inlineCount];
+  std::vector<Expr*> overflow_;
+  size_t             count_;
+};
+
+struct Lambda;
+struct Proto;
+
+// Builtins that call sites can specialize into inline integer arithmetic
+enum Intrinsic {
+  NO_INTRINSIC,
+  INT_ADD,
+  INT_SUB,
+  INT_MUL,
+  INT_DIV,
+  INT_MOD,
+  INT_EQ,
+  INT_LT,
+  INT_GT,
+};
+
+// Functions can be called two ways.  As a Form they receive their arguments 
+// unevaluated along with the caller's scope.  Strict functions also provide
+// a Native entry point that takes arguments which have already been evaluated
+// left to right, which is what the VM uses.
 struct Fun : public Atom {
-  Fun(std::function<Expr*(List*, Scope*)> f) : Atom(this), fun(f) {} 
-
-  template <typename...S>
-  static Fun* native(void (*f)(S...)) {
-    return new Fun([=](List* pArgs, Scope* pScope) {
-      std::tuple<S...> t;
-      fillTupleWithList(t, pArgs, pScope);
-      corvid::apply(f, t);
-      return nil;
+  typedef std::function<Expr*(List* pArgs, Scope* pScope)>  Form;
+  typedef std::function<Expr*(Expr** ppArgs, size_t count)> Native;
+
+  Fun(const Form& f) 
+  : Atom(FUN)
+  , fun(f)
+  , intrinsic(NO_INTRINSIC)
+  , pure(false)
+  , pName(0)
+  , pLambda(0)
+  , pProto(0)
+  , pEnv(0) {
+  } 
+
+  // Both entry points hold the native itself, not another std::function
+  // wrapping it, so either way a call is a single indirect jump
+  template <typename N>
+  static Fun* strict(const N& native) {
+    auto pFun = new Fun([=](List* pArgs, Scope* pScope) -> Expr* {
+      RootScope roots;
+      Arguments args(pArgs, pScope);
+      return native(args.data(), args.size());
     });
+    pFun->call = native;
+    return pFun;
   }
 
-  template <typename...S>
-  static Fun* native(bool (*f)(S...)) {
-    return new Fun([=](List* pArgs, Scope* pScope) -> Expr* {
-      std::tuple<S...> t;
-      fillTupleWithList(t, pArgs, pScope);
-      if (corvid::test(f, t)) {
-        return new Int(1);
-      } else {
-        return nil;
-      }
-    });
+  static bool is(const Expr* pExpr) {
+    return isHeap(pExpr) && pExpr->type == FUN;
   }
 
+  // Closures register whatever their std::function captured so the collector
+  // can see through it
+  Fun* capture(Cell* pCell) {
+    captures_.push_back(pCell);
+    return this;
+  }
 
-  template <typename R, typename...S>
-  static Fun* native(R (*f)(S...)) {
-    return new Fun([=](List* pArgs, Scope* pScope) {
-      std::tuple<S...> t;
-      fillTupleWithList(t, pArgs, pScope);
-      return new typename FromNative<R>::Type(corvid::apply(f, t));
-    });
+  Fun* capture(Expr* pExpr) {
+    if (isHeap(pExpr)) {
+      captures_.push_back(pExpr);
+    }
+    return this;
   }
 
+  void trace(Gc& gc) {
+    for (auto pCell : captures_) {
+      gc.mark(pCell);
+    }
+  }
+
+  // Binds a C++ function, lambda or member function; see Bindings.h
+  template <typename R, typename...S>
+  static Fun* native(R (*f)(S...));
+
+  template <typename F>
+  static Fun* native(const F& f);
+
+  template <typename R, typename C, typename...S>
+  static Fun* native(R (C::*f)(S...));
+
+  template <typename R, typename C, typename...S>
+  static Fun* native(R (C::*f)(S...) const);
+
   void print() {
     std::cout << "<function>";
   }
@@ -378,72 +1363,304 @@ struct Fun : public Atom {
     return this;
   }
 
-  std::function<Expr*(List*, Scope*)> fun;
+  Form               fun;
+  Native             call;
+  Intrinsic          intrinsic;
+  bool               pure;
+
+  // The symbol it was first defined as, if any, for the profiler
+  Expr*              pName;
+
+  // Closures over a Lambda (run by the tree walker) or a Proto (compiled to
+  // bytecode) are called directly by their evaluator rather than through fun
+  // or call, so calls in tail position need no C++ stack.  pEnv is the scope
+  // they close over.
+  Lambda*            pLambda;
+  Proto*             pProto;
+  Scope*             pEnv;
+
+  std::vector<Cell*> captures_;
+};
+
+inline bool isPure(const Expr* pExpr) {
+  return Fun::is(pExpr) && static_cast<const Fun*>(pExpr)->pure;
+}
+
+// Functions are named after the first variable they are defined as
+inline void nameFun(Expr* pValue, SymId symbol) {
+  if (Fun::is(pValue) && !static_cast<Fun*>(pValue)->pName) {
+    static_cast<Fun*>(pValue)->pName = Sym::box(symbol);
+  }
+}
+
+// A lambda expression after lexical addressing.  Evaluating it closes over 
+// the current scope and yields a Fun whose activation frames have frameSize
+// slots, the first of which hold the arguments.
+struct Lambda : public Atom {
+  // Native code for the body, given the closure and a frame holding its
+  // arguments
+  typedef Expr* (*Compiled)(Fun* pSelf, Scope* pFrame);
+
+  Lambda(const std::vector<SymId>& p, Expr* pB, size_t n) 
+  : Atom(LAMBDA)
+  , params(p)
+  , pBody(pB)
+  , frameSize(n)
+  , calls(0)
+  , compiled(0) {
+  } 
+
+  static bool is(const Expr* pExpr) {
+    return isHeap(pExpr) && pExpr->type == LAMBDA;
+  }
+
+  void trace(Gc& gc) {
+    markExpr(gc, pBody);
+  }
+
+  void print() {
+    std::cout << "<lambda>";
+  }
+
+  Expr* eval (Scope* pScope);
+
+  std::vector<SymId> params;
+  Expr*              pBody;
+  size_t             frameSize;
+
+  // Invocations so far, and the JIT's code once there have been enough
+  size_t             calls;
+  Compiled           compiled;
+};
+
+// A procedure call after lexical addressing.  The first time it runs a call
+// site looks at what it is calling and with what: a site that sees an 
+// intrinsic builtin applied to two numbers specializes itself to do the 
+// integer arithmetic inline, guarded on the callee being the same Fun and the
+// arguments still being numbers.  When a guard fails the site deoptimizes to
+// a generic call for good.
+struct Call : public Atom {
+  enum State {
+    UNINITIALIZED,
+    SPECIALIZED,
+    GENERIC,
+  };
+
+  Call(List* pF) 
+  : Atom(CALL)
+  , pForm(pF)
+  , argc(pF->pTail ? pF->pTail->length() : 0)
+  , state(UNINITIALIZED)
+  , pCached(0) {
+  } 
+
+  static bool is(const Expr* pExpr) {
+    return isHeap(pExpr) && pExpr->type == CALL;
+  }
+
+  void trace(Gc& gc) {
+    gc.mark(pForm);
+    gc.mark(pCached);
+  }
+
+  void print() {
+    pForm->print();
+  }
+
+  Expr* eval (Scope* pScope);
+
+  // The result of calling pFun, or 0 if the call should go the generic way
+  Expr* specialized(Fun* pFun, Scope* pScope);
+
+  List*  pForm;
+  size_t argc;
+  State  state;
+  Fun*   pCached;
+};
+
+// A call to a pure builtin with constant arguments, done once when it was 
+// loaded (see Folder.h).  The value stands while every global slot the call
+// went through, its own and those of any calls folded into its arguments, 
+// holds the builtin it held then.  While one is rebound the call is made 
+// again each time, and putting the builtin back makes the value good again.
+struct Folded : public Atom {
+  struct Dependency {
+    Expr** ppSlot;
+    Expr*  pBuiltin;
+  };
+
+  Folded(Expr* pV, Expr* pF, const std::vector<Dependency>& d) 
+  : Atom(FOLDED)
+  , pValue(pV)
+  , pForm(pF)
+  , dependencies(d)
+  , shadowEpoch(Scope::shadowEpoch) {
+  }
+
+  static bool is(const Expr* pExpr) {
+    return isHeap(pExpr) && pExpr->type == FOLDED;
+  }
+
+  // A builtin that has been rebound stays marked, so no new cell can turn 
+  // up at its address and pass for it
+  void trace(Gc& gc) {
+    markExpr(gc, pValue);
+    markExpr(gc, pForm);
+    for (auto& dependency : dependencies) {
+      markExpr(gc, dependency.pBuiltin);
+    }
+  }
+
+  void print() {
+    printExpr(pValue);
+  }
+
+  // Anything bound by name in a local scope (the Resolver gives most locals
+  // slots instead) might shadow one of the globals, so that ends it for good
+  bool current() const {
+    if (shadowEpoch != Scope::shadowEpoch) {
+      return false;
+    }
+    for (auto& dependency : dependencies) {
+      if (*dependency.ppSlot != dependency.pBuiltin) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  Expr* eval(Scope* pScope) {
+    if (current()) {
+      return pValue;
+    }
+    return evalExpr(pForm, pScope);
+  }
+
+  Expr*                   pValue;
+  Expr*                   pForm;
+  std::vector<Dependency> dependencies;
+  size_t                  shadowEpoch;
 };
 
+// Special forms are indexed by the interned id of their keyword
+typedef Expr* (*SpecialForm)(List* pList, Scope* pScope);
+
+std::vector<SpecialForm> specialForms;
+
+// Which of metrics().forms counts each special form, by symbol
+std::vector<size_t> specialFormMetrics;
+
+inline void defineSpecialForm(const std::string& keyword, SpecialForm form) {
+  auto id = symbols.intern(keyword);
+  if (id >= specialForms.size()) {
+    specialForms.resize(id + 1);
+    specialFormMetrics.resize(id + 1);
+  }
+  specialForms[id] = form;
+  specialFormMetrics[id] = metricsRegistry.nameForm(keyword);
+}
+
+inline void countSpecialForm(Expr* pKeyword) {
+  metrics().forms[specialFormMetrics[Sym::unbox(pKeyword)]].bump();
+}
+
+inline SpecialForm getSpecialForm(Expr* pExpr) {
+  if (Sym::is(pExpr)) {
+    auto id = Sym::unbox(pExpr);
+    if (id < specialForms.size()) {
+      return specialForms[id];
+    }
+  }
+  return 0;
+}
+
 
 //------------------------------------------------------------------------------
 // Type checking/coersion
-template <typename T> T* as(Expr* pExpr) { return nil; }
+//
+// Heap types are returned as pointers, immediates are unboxed by value so that
+// reading an Int or Float never allocates.
+template <typename T> struct AsType        { typedef T*    Type; };
+template <>           struct AsType<Int>   { typedef int   Type; };
+template <>           struct AsType<Float> { typedef float Type; };
+template <>           struct AsType<Sym>   { typedef SymId Type; };
+
+template <typename T> typename AsType<T>::Type as(Expr* pExpr); 
 
 template <> Fun* as<Fun>(Expr* pExpr) { 
-  if (pExpr && pExpr->pAtom && pExpr->pAtom->pFun) {
-    return pExpr->pAtom->pFun;
+  if (Fun::is(pExpr)) {
+    return static_cast<Fun*>(pExpr);
   }
 
-  throw std::runtime_error("Type error: s-expr not a function!");
+  typeError("Type error: s-expr not a function!");
 }
 
 template <> Str* as<Str>(Expr* pExpr) { 
-  if (pExpr && pExpr->pAtom && pExpr->pAtom->pStr) {
-    return pExpr->pAtom->pStr;
+  if (Str::is(pExpr)) {
+    return static_cast<Str*>(pExpr);
   }
 
-  throw std::runtime_error("Type error: s-expr not a string!");
+  typeError("Type error: s-expr not a string!");
 }
 
-template <> Int* as<Int>(Expr* pExpr) { 
-  if (pExpr && pExpr->pAtom && pExpr->pAtom->pInt) {
-    return pExpr->pAtom->pInt;
+template <> Vector* as<Vector>(Expr* pExpr) { 
+  if (Vector::is(pExpr)) {
+    return static_cast<Vector*>(pExpr);
   }
 
-  if (pExpr && pExpr->pAtom && pExpr->pAtom->pFloat) {
-    return new Int(pExpr->pAtom->pFloat->num);
+  typeError("Type error: s-expr not a vector!");
+}
+
+template <> Array* as<Array>(Expr* pExpr) { 
+  if (Array::is(pExpr)) {
+    return static_cast<Array*>(pExpr);
   }
 
-  throw std::runtime_error("Type error: s-expr not an int!");
+  typeError("Type error: s-expr not an array!");
 }
 
-template <> Float* as<Float>(Expr* pExpr) { 
-  if (pExpr && pExpr->pAtom && pExpr->pAtom->pFloat) {
-    return pExpr->pAtom->pFloat;
+template <> Dict* as<Dict>(Expr* pExpr) { 
+  if (Dict::is(pExpr)) {
+    return static_cast<Dict*>(pExpr);
   }
 
-  throw std::runtime_error("Type error: s-expr not a float!");
+  typeError("Type error: s-expr not a dict!");
 }
 
-template <> Sym* as<Sym>(Expr* pExpr) { 
-  if (pExpr && pExpr->pAtom && pExpr->pAtom->pSym) {
-    return pExpr->pAtom->pSym;
+template <> int as<Int>(Expr* pExpr) { 
+  if (Int::is(pExpr)) {
+    return Int::unbox(pExpr);
   }
 
-  throw std::runtime_error("Type error: s-expr not a symbol!");
+  if (Float::is(pExpr)) {
+    return Float::unbox(pExpr);
+  }
+
+  typeError("Type error: s-expr not an int!");
 }
 
-template <> List* as<List>(Expr* pExpr) { 
-  if (pExpr && pExpr->pList) {
-    return pExpr->pList;
+template <> float as<Float>(Expr* pExpr) { 
+  if (Float::is(pExpr)) {
+    return Float::unbox(pExpr);
   }
 
-  throw std::runtime_error("Type error: s-expr not a list!");
+  typeError("Type error: s-expr not a float!");
 }
 
-template <> Atom* as<Atom>(Expr* pExpr) { 
-  if (pExpr && pExpr->pAtom) {
-    return pExpr->pAtom;
+template <> SymId as<Sym>(Expr* pExpr) { 
+  if (Sym::is(pExpr)) {
+    return Sym::unbox(pExpr);
   }
 
-  throw std::runtime_error("Type error: s-expr not an atom!");
+  typeError("Type error: s-expr not a symbol!");
+}
+
+template <> List* as<List>(Expr* pExpr) { 
+  if (List::is(pExpr)) {
+    return static_cast<List*>(pExpr);
+  }
+
+  typeError("Type error: s-expr not a list!");
 }
 
 template <> Expr* as<Expr>(Expr* pExpr) { 
@@ -451,8 +1668,9 @@ template <> Expr* as<Expr>(Expr* pExpr) {
     return pExpr;
   }
 
-  throw std::runtime_error("Type error: expected s-expr!");
+  typeError("Type error: expected s-expr!");
 }
 
 }
 
+//------------------------------------------------------------------------------
@@ -0,0 +1,320 @@
+//------------------------------------------------------------------------------
+/*
+*  
+*  The MIT License (MIT)
+* 
+*  Copyright (C) 2014 Cody Griffin (cody.m.griffin@gmail.com)
+* 
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+* 
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+* 
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*/
+
+
+#ifndef INCLUDED_EXPANDER_H
+#define INCLUDED_EXPANDER_H
+
+namespace corvid {
+
+//------------------------------------------------------------------------------
+/* 
+ *  Macros, expanded as each form is read, before the Resolver sees it.
+ *
+ *    (defmacro (name params...) body)
+ *
+ *  defines name as a macro for the forms read after it.  A call to a macro 
+ *  is handed its arguments as unevaluated forms and the form it returns 
+ *  takes the call's place, expanded in turn.  A parameter after & gets the
+ *  rest of the arguments as a list.  Each form is expanded once, in place, 
+ *  so what runs is only ever the expansion.
+ *
+ *  Macros build their expansions with (quasiquote template), in which 
+ *  (unquote expr) is replaced by the value of expr and (unquote-splicing 
+ *  expr) by the elements of the list it evaluates to.  quasiquote is itself
+ *  expanded into calls that build the list, so it costs no more than 
+ *  building the list by hand.  Templates do not nest.
+ */
+struct Macro {
+  Fun*   pFun;
+  size_t params;
+  bool   rest;      // The last parameter takes the rest of the arguments
+};
+
+struct Macros {
+  Macros() : pCons_(0), pAppend_(0) {
+    gc.addRoots([this](Gc& gc) {
+      for (auto& macro : table) {
+        gc.mark(macro.second.pFun);
+      }
+      gc.mark(pCons_);
+      gc.mark(pAppend_);
+    });
+  }
+
+  // Expanded quasiquotes call these directly, so that nothing the program 
+  // binds can get in their way
+  Fun* cons() {
+    if (!pCons_) {
+      pCons_ = Fun::strict([](Expr** ppArgs, size_t) {
+        return new List(ppArgs[0], as<List>(ppArgs[1]));
+      });
+    }
+    return pCons_;
+  }
+
+  Fun* append() {
+    if (!pAppend_) {
+      pAppend_ = Fun::strict([](Expr** ppArgs, size_t) {
+        std::vector<Expr*> items;
+        for (auto pList = as<List>(ppArgs[0]); pList && pList->pHead; 
+             pList = pList->pTail) {
+          items.push_back(pList->pHead);
+        }
+
+        auto pList = as<List>(ppArgs[1]);
+        for (auto it = items.rbegin(); it != items.rend(); ++it) {
+          pList = new List(*it, pList);
+        }
+        return pList;
+      });
+    }
+    return pAppend_;
+  }
+
+  std::unordered_map<SymId, Macro> table;
+
+private:
+  Fun* pCons_;
+  Fun* pAppend_;
+};
+
+Macros macros;
+
+struct Expander {
+  Expander() 
+  : defmacro_       (symbols.intern("defmacro"))
+  , quote_          (symbols.intern("quote"))
+  , quasiquote_     (symbols.intern("quasiquote"))
+  , unquote_        (symbols.intern("unquote"))
+  , unquoteSplicing_(symbols.intern("unquote-splicing"))
+  , lambda_         (symbols.intern("lambda"))
+  , slash_          (symbols.intern(".\\"))
+  , define_         (symbols.intern("define"))
+  , defmemo_        (symbols.intern("defmemo"))
+  , rest_           (symbols.intern("&")) {
+  }
+
+  // Anything a macro returns is rooted, since macros run code
+  Expr* expand(Expr* pExpr) {
+    for (;;) {
+      if (!List::is(pExpr) || !static_cast<List*>(pExpr)->pHead) {
+        return pExpr;
+      }
+
+      auto pList = static_cast<List*>(pExpr);
+      if (!Sym::is(pList->pHead)) {
+        break;
+      }
+
+      auto keyword = Sym::unbox(pList->pHead);
+      if (keyword == quote_) {
+        return pList;
+      }
+      if (keyword == quasiquote_) {
+        return quasiquote(pList->get(1));
+      }
+      if (keyword == defmacro_) {
+        return defineMacro(pList);
+      }
+
+      auto it = macros.table.find(keyword);
+      if (it == macros.table.end()) {
+        break;
+      }
+      pExpr = rootExpr(copy(rootExpr(call(it->second, pList))));
+    }
+
+    // Parameter lists and the names being defined are not calls
+    auto pList = static_cast<List*>(pExpr);
+    if (Sym::is(pList->pHead)) {
+      auto keyword = Sym::unbox(pList->pHead);
+      if (keyword == lambda_ || keyword == slash_ || 
+          keyword == define_ || keyword == defmemo_) {
+        expandEach(pList->pTail->pTail);
+        return pList;
+      }
+    }
+
+    expandEach(pList);
+    return pList;
+  }
+
+private:
+  void expandEach(List* pList) {
+    for (; pList && pList->pHead; pList = pList->pTail) {
+      pList->pHead = expand(pList->pHead);
+    }
+  }
+
+  Expr* call(const Macro& macro, List* pList) {
+    std::vector<Expr*> args;
+    for (auto pArgs = pList->pTail; pArgs && pArgs->pHead; 
+         pArgs = pArgs->pTail) {
+      args.push_back(pArgs->pHead);
+    }
+
+    RootScope roots;
+    if (macro.rest) {
+      auto fixed = macro.params - 1;
+      if (args.size() < fixed) {
+        throw std::runtime_error("Too few arguments to macro!");
+      }
+
+      auto pRest = nil;
+      for (auto i = args.size(); i > fixed; i--) {
+        pRest = new List(args[i - 1], pRest);
+      }
+      args.resize(fixed);
+      args.push_back(rootExpr(pRest));
+    }
+    return macro.pFun->call(args.data(), args.size());
+  }
+
+  // A macro can put one of its arguments in its expansion more than once,
+  // and the Resolver rewrites forms in place, so each place gets its own
+  static Expr* copy(Expr* pExpr) {
+    if (!List::is(pExpr) || !static_cast<List*>(pExpr)->pHead) {
+      return pExpr;
+    }
+
+    std::vector<Expr*> items;
+    auto pList = static_cast<List*>(pExpr);
+    for (; pList && pList->pHead; pList = pList->pTail) {
+      items.push_back(copy(pList->pHead));
+    }
+    for (auto it = items.rbegin(); it != items.rend(); ++it) {
+      pList = new List(*it, pList);
+    }
+    return pList;
+  }
+
+  // (defmacro (name params...) body) makes (lambda (params...) body) into
+  // the macro, leaving (quote name) in its place
+  Expr* defineMacro(List* pList) {
+    auto pSignature = as<List>(pList->get(1));
+    auto symbol     = as<Sym>(pSignature->pHead);
+
+    Macro  macro   = { 0, 0, false };
+    List*  pParams = nil;
+    std::vector<Expr*> params;
+    for (auto pArgs = pSignature->pTail; pArgs && pArgs->pHead; 
+         pArgs = pArgs->pTail) {
+      if (as<Sym>(pArgs->pHead) == rest_) {
+        macro.rest = true;
+        continue;
+      }
+      params.push_back(pArgs->pHead);
+    }
+    if (macro.rest && (params.empty() || 
+                       as<Sym>(pSignature->get(params.size())) != rest_)) {
+      throw std::runtime_error("Expected one parameter after &!");
+    }
+    for (auto it = params.rbegin(); it != params.rend(); ++it) {
+      pParams = new List(*it, pParams);
+    }
+    macro.params = params.size();
+
+    RootScope roots;
+    auto pLambda = rootExpr(new List(Sym::box(lambda_), 
+                            new List(pParams, 
+                            new List(pList->get(2), nil))));
+    macro.pFun = as<Fun>(evalTopLevel(fold(resolve(expand(pLambda)))));
+    macros.table[symbol] = macro;
+
+    return new List(Sym::box(quote_), new List(Sym::box(symbol), nil));
+  }
+
+  // The code that builds what the template describes
+  Expr* quasiquote(Expr* pTemplate) {
+    if (!List::is(pTemplate) || !static_cast<List*>(pTemplate)->pHead) {
+      return quote(pTemplate);
+    }
+
+    auto pList = static_cast<List*>(pTemplate);
+    if (isForm(pList, unquote_)) {
+      return expand(pList->get(1));
+    }
+
+    std::vector<Expr*> items;
+    for (; pList && pList->pHead; pList = pList->pTail) {
+      items.push_back(pList->pHead);
+    }
+
+    RootScope roots;
+    Expr* pCode = nil;
+    for (auto it = items.rbegin(); it != items.rend(); ++it) {
+      if (isForm(*it, unquoteSplicing_)) {
+        auto pItems = expand(static_cast<List*>(*it)->get(1));
+        pCode = apply(macros.append(), pItems, pCode);
+      } else {
+        pCode = apply(macros.cons(), quasiquote(*it), pCode);
+      }
+      rootExpr(pCode);
+    }
+    return pCode;
+  }
+
+  bool isForm(Expr* pExpr, SymId keyword) const {
+    if (!List::is(pExpr)) {
+      return false;
+    }
+    auto pHead = static_cast<List*>(pExpr)->pHead;
+    return Sym::is(pHead) && Sym::unbox(pHead) == keyword;
+  }
+
+  // Numbers and strings evaluate to themselves, anything else is quoted
+  Expr* quote(Expr* pExpr) {
+    if (Int::is(pExpr) || Float::is(pExpr) || Str::is(pExpr)) {
+      return pExpr;
+    }
+    return new List(Sym::box(quote_), new List(pExpr, nil));
+  }
+
+  static List* apply(Fun* pFun, Expr* pFirst, Expr* pSecond) {
+    return new List(pFun, new List(pFirst, new List(pSecond, nil)));
+  }
+
+  SymId defmacro_;
+  SymId quote_;
+  SymId quasiquote_;
+  SymId unquote_;
+  SymId unquoteSplicing_;
+  SymId lambda_;
+  SymId slash_;
+  SymId define_;
+  SymId defmemo_;
+  SymId rest_;
+};
+
+inline Expr* expand(Expr* pExpr) {
+  RootScope roots;
+  return Expander().expand(rootExpr(pExpr));
+}
+
+} // namespace corvid
+
+#endif
@@ -0,0 +1,199 @@
+//------------------------------------------------------------------------------
+/*
+*  
+*  The MIT License (MIT)
+* 
+*  Copyright (C) 2014 Cody Griffin (cody.m.griffin@gmail.com)
+* 
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+* 
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+* 
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*/
+
+
+#ifndef INCLUDED_FOLDER_H
+#define INCLUDED_FOLDER_H
+
+namespace corvid {
+
+//------------------------------------------------------------------------------
+/* 
+ *  The Folder runs over each form after the Resolver and before evaluation.
+ *  A call to a pure builtin (see pure() in initGlobalScope) whose arguments 
+ *  are all constants is made there and then, and replaced with a Folded node
+ *  holding the result; folding works bottom up, so (* 60 (* 60 24)) becomes 
+ *  86400, as does (* 60 60 24).  An if whose condition is a literal is 
+ *  replaced with the branch it would take.  One whose condition folded 
+ *  becomes a Folded node itself if the branch it takes is constant too, and 
+ *  otherwise keeps both branches for when the condition no longer holds.
+ *
+ *  Only globals are folded (the Resolver has already turned anything bound 
+ *  in a lambda into a Local), and only while they are bound to the builtin.
+ *  Should one be rebound later the Folded nodes notice and make the call 
+ *  again, until the builtin is put back.  Calls that would fail, and 
+ *  divisions by zero, are left to fail when they run.
+ */
+struct Folder {
+  Folder(Scope* pGlobals) 
+  : pGlobals_(pGlobals)
+  , quote_(symbols.intern("quote"))
+  , if_   (symbols.intern("if")) {
+  }
+
+  Expr* fold(Expr* pExpr) {
+    if (Lambda::is(pExpr)) {
+      auto pLambda   = static_cast<Lambda*>(pExpr);
+      pLambda->pBody = fold(pLambda->pBody);
+      return pLambda;
+    }
+
+    if (Call::is(pExpr)) {
+      auto pCall = static_cast<Call*>(pExpr);
+      foldEach(pCall->pForm->pTail);
+      return foldCall(pCall);
+    }
+
+    if (!List::is(pExpr) || !static_cast<List*>(pExpr)->pHead) {
+      return pExpr;
+    }
+
+    // What is left is a special form
+    auto pList = static_cast<List*>(pExpr);
+    if (Sym::is(pList->pHead) && Sym::unbox(pList->pHead) == quote_) {
+      return pList;
+    }
+
+    foldEach(pList->pTail);
+    if (Sym::is(pList->pHead) && Sym::unbox(pList->pHead) == if_) {
+      return foldIf(pList);
+    }
+    return pList;
+  }
+
+private:
+  void foldEach(List* pList) {
+    for (; pList && pList->pHead; pList = pList->pTail) {
+      pList->pHead = fold(pList->pHead);
+    }
+  }
+
+  typedef std::vector<Folded::Dependency> Dependencies;
+
+  // Numbers and strings, and anything already folded, whose value depends on
+  // the same globals it did
+  static bool constant(Expr* pExpr, Expr*& pValue, Dependencies& deps) {
+    if (Int::is(pExpr) || Float::is(pExpr) || Str::is(pExpr)) {
+      pValue = pExpr;
+      return true;
+    }
+    if (Folded::is(pExpr)) {
+      auto pFolded = static_cast<Folded*>(pExpr);
+      pValue = pFolded->pValue;
+      for (auto& dependency : pFolded->dependencies) {
+        depend(deps, dependency.ppSlot);
+      }
+      return true;
+    }
+    return false;
+  }
+
+  static void depend(Dependencies& deps, Expr** ppSlot) {
+    for (auto& dependency : deps) {
+      if (dependency.ppSlot == ppSlot) {
+        return;
+      }
+    }
+    Folded::Dependency dependency = { ppSlot, *ppSlot };
+    deps.push_back(dependency);
+  }
+
+  Expr* foldCall(Call* pCall) {
+    auto pHead = pCall->pForm->pHead;
+    if (!Sym::is(pHead)) {
+      return pCall;
+    }
+
+    auto ppFun = pGlobals_->findGlobal(Sym::unbox(pHead));
+    if (!ppFun || !isPure(*ppFun)) {
+      return pCall;
+    }
+
+    std::vector<Expr*> args;
+    Dependencies       deps;
+    depend(deps, ppFun);
+    for (auto pArgs = pCall->pForm->pTail; pArgs && pArgs->pHead; 
+         pArgs = pArgs->pTail) {
+      Expr* pValue;
+      if (!constant(pArgs->pHead, pValue, deps)) {
+        return pCall;
+      }
+      args.push_back(pValue);
+    }
+
+    // Any argument after the first divides, since (/ a b c) is (/ (/ a b) c)
+    auto pFun = static_cast<Fun*>(*ppFun);
+    if (pFun->intrinsic == INT_DIV || pFun->intrinsic == INT_MOD) {
+      for (size_t i = 1; i < args.size(); i++) {
+        if (isNumber(args[i]) && as<Int>(args[i]) == 0) {
+          return pCall;
+        }
+      }
+    }
+
+    try {
+      return new Folded(pFun->call(args.data(), args.size()), pCall, deps);
+    } catch (std::exception&) {
+      return pCall;
+    }
+  }
+
+  // Numbers and strings are true, lists false
+  Expr* foldIf(List* pList) {
+    auto pCondition = pList->get(1);
+    if (Int::is(pCondition) || Float::is(pCondition) || Str::is(pCondition)) {
+      return pList->get(2);
+    }
+    if (List::is(pCondition) && !static_cast<List*>(pCondition)->pHead) {
+      return pList->get(3);
+    }
+    if (!Folded::is(pCondition)) {
+      return pList;
+    }
+
+    // The if itself is what gets evaluated should the condition not hold
+    Expr*        pValue;
+    Dependencies deps;
+    constant(pCondition, pValue, deps);
+    auto pBranch = pList->get(List::is(pValue) ? 3 : 2);
+    if (!constant(pBranch, pValue, deps)) {
+      return pList;
+    }
+    return new Folded(pValue, pList, deps);
+  }
+
+  Scope* pGlobals_;
+  SymId  quote_;
+  SymId  if_;
+};
+
+inline Expr* fold(Expr* pExpr) {
+  return Folder(pGlobalScope).fold(pExpr);
+}
+
+} // namespace corvid
+
+#endif
@@ -0,0 +1,178 @@
+//------------------------------------------------------------------------------
+/*
+*  
+*  The MIT License (MIT)
+* 
+*  Copyright (C) 2014 Cody Griffin (cody.m.griffin@gmail.com)
+* 
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+* 
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+* 
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*/
+
+
+
+#ifndef INCLUDED_FUTURE_H
+#define INCLUDED_FUTURE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+
+namespace corvid {
+
+//------------------------------------------------------------------------------
+/* 
+ *  (future expr) starts evaluating expr on the thread pool and returns at 
+ *  once; (await f) waits for the value, rethrowing anything the evaluation
+ *  threw, and (future-ready? f) asks whether it is done without waiting.
+ *
+ *  expr is evaluated in a snapshot of the scope it appears in, taken when 
+ *  the future is made, so later changes on either side go unseen by the 
+ *  other.  The globals are not in the snapshot but shared: as in a parallel
+ *  section they are read-only to the future, and a define or set! of one on
+ *  the main thread waits until every running future has finished (see 
+ *  Scope::checkWritable).
+ *
+ *  Whichever gets to a future first runs it: a worker, or a thread awaiting 
+ *  it that finds it still queued, so futures awaiting futures cannot starve
+ *  the pool.  A future made on a worker is just run there and then.
+ *
+ *  A running future allocates through its own Mutator, lent to the Gc, and
+ *  collections wait until it has finished.
+ */
+struct Future : public Atom {
+  enum State {
+    QUEUED,
+    RUNNING,
+    DONE,
+  };
+
+  Future(Expr* pE, Scope* pS) 
+  : Atom(FUTURE)
+  , pExpr(pE)
+  , pScope(pS)
+  , pResult(nil)
+  , state(QUEUED) {
+  }
+
+  static bool is(const Expr* pExpr) {
+    return isHeap(pExpr) && pExpr->type == FUTURE;
+  }
+
+  void trace(Gc& gc) {
+    markExpr(gc, pExpr);
+    gc.mark(pScope);
+    markExpr(gc, pResult);
+  }
+
+  void print() {
+    std::cout << (ready() ? "<future ready>" : "<future>");
+  }
+
+  Expr* eval (Scope* pScope) {
+    return this;
+  }
+
+  bool ready() const {
+    return state == DONE;
+  }
+
+  bool claim() {
+    State queued = QUEUED;
+    return state.compare_exchange_strong(queued, RUNNING);
+  }
+
+  void run() {
+    try {
+      RootScope roots;
+      pResult = evalExpr(pExpr, pScope);
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    state = DONE;
+    done.notify_all();
+  }
+
+  Expr* await() {
+    if (claim()) {
+      run();
+    } else {
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [this] { return ready(); });
+    }
+
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    return pResult;
+  }
+
+  Expr*                   pExpr;
+  Scope*                  pScope;
+  Expr*                   pResult;
+  std::exception_ptr      error;
+
+  std::atomic<State>      state;
+  std::mutex              mutex;
+  std::condition_variable done;
+  Mutator                 mutator;
+};
+
+template <> Future* as<Future>(Expr* pExpr) { 
+  if (Future::is(pExpr)) {
+    return static_cast<Future*>(pExpr);
+  }
+
+  typeError("Type error: s-expr not a future!");
+}
+
+template <>
+struct Unpack<Future*> {
+  static Future* get(Expr* pValue) {
+    return as<Future>(pValue);
+  }
+};
+
+Expr* evalFutureForm(List* pList, Scope* pScope) {
+  auto pFuture = new Future(pList->get(1), pScope->snapshot());
+  if (gc.isWorker()) {
+    pFuture->claim();
+    pFuture->run();
+    return pFuture;
+  }
+
+  // Setting finished is the last the worker does with the future, since the
+  // collector may free it as soon as the mutator is reclaimed
+  gc.lend(&pFuture->mutator);
+  pool.submit([pFuture] {
+    if (pFuture->claim()) {
+      auto pWorker = gc.attach(&pFuture->mutator);
+      pFuture->run();
+      gc.attach(pWorker);
+    }
+    pFuture->mutator.finished = true;
+  });
+  return pFuture;
+}
+
+} // namespace corvid
+
+#endif
@@ -0,0 +1,378 @@
+//------------------------------------------------------------------------------
+/*
+*  
+*  The MIT License (MIT)
+* 
+*  Copyright (C) 2014 Cody Griffin (cody.m.griffin@gmail.com)
+* 
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+* 
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+* 
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*/
+
+
+#ifndef INCLUDED_GC_H
+#define INCLUDED_GC_H
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+
+namespace corvid {
+
+//------------------------------------------------------------------------------
+/* 
+ *  A precise mark-and-sweep collector for everything the evaluator allocates.
+ *
+ *  Every heap object derives from Cell, which threads it onto the collector's
+ *  list of live cells and accounts for its size.  Objects are found through
+ *  roots:
+ *
+ *   - permanent roots (the global scope, nil) registered with addRoots, and
+ *     roots that live as long as some thread does, which are removed again
+ *   - the shadow stack of C++ frames, pushed with root() inside a RootScope
+ *
+ *  Collections only run at safepoints (poll), so native code is free to hold
+ *  unrooted pointers as long as it does not evaluate anything in between.
+ *
+ *  Threads in a parallel section allocate through a Mutator of their own: a
+ *  private cell list and root stack, with polling switched off.  The thread
+ *  that started the section waits for it and then adopts every worker's 
+ *  cells, so nothing is collected while the workers run.  A mutator can also
+ *  be lent to work that runs alongside the main thread, a future say, in 
+ *  which case collections are put off until it has finished and been adopted.
+ *  Until then the main thread is sharing the heap too (see isShared).
+ */
+struct Gc;
+
+#define CORVID_CELL_OPERATOR __attribute__((always_inline))
+
+struct Cell {
+  Cell();
+  virtual ~Cell() {}
+
+  // Mark any cells reachable from this one
+  virtual void trace(Gc& gc) {}
+
+  // Both always inline, so a new expression pairs the global operators on
+  // either side (half inlined, -Wmismatched-new-delete flags every new)
+  static void* operator new   (size_t size)         CORVID_CELL_OPERATOR;
+  static void  operator delete(void* p, size_t size) CORVID_CELL_OPERATOR;
+
+  Cell* pNextCell_;
+  bool  marked_;
+};
+
+struct GcStats {
+  GcStats() 
+  : cells(0)
+  , bytes(0)
+  , collections(0)
+  , freedCells(0)
+  , lastPause(0)
+  , maxPause(0)
+  , totalPause(0) {
+  }
+
+  size_t cells;
+  size_t bytes;
+  size_t collections;
+  size_t freedCells;
+  double lastPause;    // milliseconds
+  double maxPause;
+  double totalPause;
+};
+
+// Allocation state private to one worker thread
+struct Mutator {
+  Mutator() : pCells(0), cells(0), bytes(0), finished(false) {}
+
+  Cell*               pCells;
+  size_t              cells;
+  size_t              bytes;
+  std::vector<Cell*>  stack;
+  std::atomic<bool>   finished;
+};
+
+struct Gc {
+  Gc() 
+  : pCells_(0)
+  , lastRoots_(0)
+  , pStack_(&stack_)
+  , threshold_(minThreshold)
+  , allocatedSinceGc_(0)
+  , log_(getenv("CORVID_GC_LOG") != 0) {
+  }
+
+  // Don't bother freeing anything on the way out
+  ~Gc() {}
+
+  static const size_t minThreshold = 4 << 20;
+
+  void mark(Cell* pCell) {
+    if (pCell && !pCell->marked_) {
+      pCell->marked_ = true;
+      grey_.push_back(pCell);
+    }
+  }
+
+  // Permanent roots are marked by a callback on every collection
+  typedef std::function<void(Gc& gc)> Roots;
+  typedef size_t                      RootsId;
+
+  // Threads register these as they start and remove them as they exit, so 
+  // the callbacks are locked
+  RootsId addRoots(const Roots& roots) {
+    std::lock_guard<std::mutex> lock(rootsMutex_);
+    roots_.push_back(std::make_pair(++lastRoots_, roots));
+    return lastRoots_;
+  }
+
+  void removeRoots(RootsId id) {
+    std::lock_guard<std::mutex> lock(rootsMutex_);
+    roots_.erase(std::remove_if(roots_.begin(), roots_.end(), 
+      [id](const std::pair<RootsId, Roots>& roots) { 
+        return roots.first == id; 
+      }), roots_.end());
+  }
+
+  // Temporary roots for native C++ frames, released by RootScope
+  void root(Cell* pCell) {
+    roots().push_back(pCell);
+  }
+
+  // Collect if enough has been allocated since the last collection
+  void poll() {
+    if (!pMutator_ && allocatedSinceGc_ > threshold_) {
+      collect();
+    }
+  }
+
+  void collect() {
+    if (!reclaim()) {
+      return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    {
+      std::lock_guard<std::mutex> lock(rootsMutex_);
+      for (auto& roots : roots_) roots.second(*this);
+    }
+    for (auto pCell : stack_) mark(pCell);
+
+    while (!grey_.empty()) {
+      auto pCell = grey_.back();
+      grey_.pop_back();
+      pCell->trace(*this);
+    }
+
+    size_t freed  = 0;
+    Cell** ppCell = &pCells_;
+    while (*ppCell) {
+      auto pCell = *ppCell;
+      if (pCell->marked_) {
+        pCell->marked_ = false;
+        ppCell = &pCell->pNextCell_;
+      } else {
+        *ppCell = pCell->pNextCell_;
+        stats_.cells--;
+        delete pCell;
+        freed++;
+      }
+    }
+
+    allocatedSinceGc_ = 0;
+    threshold_        = stats_.bytes > minThreshold ? stats_.bytes : minThreshold;
+
+    std::chrono::duration<double, std::milli> pause = 
+      std::chrono::steady_clock::now() - start;
+    stats_.collections++;
+    stats_.freedCells += freed;
+    stats_.lastPause   = pause.count();
+    stats_.maxPause    = std::max(stats_.maxPause, stats_.lastPause);
+    stats_.totalPause += stats_.lastPause;
+
+    if (log_) {
+      std::cerr << "[gc] freed " << freed << " cells, " 
+                << stats_.cells << " cells / " << stats_.bytes 
+                << " bytes live, pause " << stats_.lastPause << "ms" 
+                << std::endl;
+    }
+  }
+
+  void track(Cell* pCell) {
+    if (pMutator_) {
+      pCell->pNextCell_  = pMutator_->pCells;
+      pMutator_->pCells  = pCell;
+      pMutator_->cells++;
+      return;
+    }
+    pCell->pNextCell_  = pCells_;
+    pCells_            = pCell;
+    stats_.cells++;
+  }
+
+  void accountAlloc(size_t size) {
+    if (pMutator_) {
+      pMutator_->bytes += size;
+      return;
+    }
+    stats_.bytes      += size;
+    allocatedSinceGc_ += size;
+  }
+
+  void accountFree(size_t size) {
+    if (pMutator_) {
+      pMutator_->bytes -= size;
+      return;
+    }
+    stats_.bytes -= size;
+  }
+
+  // Route this thread's allocations through a private mutator (or back, if 0)
+  Mutator* attach(Mutator* pMutator) {
+    std::swap(pMutator_, pMutator);
+    return pMutator;
+  }
+
+  // Hold collections until the mutator has finished and been reclaimed
+  void lend(Mutator* pMutator) {
+    lent_.push_back(pMutator);
+  }
+
+  // Adopt every lent mutator that has finished, true if none are left
+  bool reclaim() {
+    auto it = std::remove_if(lent_.begin(), lent_.end(), [this](Mutator* p) {
+      if (!p->finished) {
+        return false;
+      }
+      adopt(*p);
+      return true;
+    });
+    lent_.erase(it, lent_.end());
+    return lent_.empty();
+  }
+
+  // Green threads each keep a shadow stack of their own and switch to it while
+  // they run.  The thread's own stack is always a root; theirs they trace.
+  std::vector<Cell*>* switchStack(std::vector<Cell*>* pStack) {
+    std::swap(pStack_, pStack);
+    return pStack;
+  }
+
+  bool isWorker() const {
+    return pMutator_ != 0;
+  }
+
+  // Whether other threads may be running alongside this one: always on a 
+  // worker, and on the main thread while anything lent to them is unfinished.
+  // Shared state such as call sites is only read while this holds.
+  bool isShared() {
+    return pMutator_ || (!lent_.empty() && !reclaim());
+  }
+
+  // Wait on the main thread for everything lent to finish
+  void settle() {
+    while (!reclaim()) {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+
+  // Take over everything a worker allocated; it must be idle
+  void adopt(Mutator& mutator) {
+    while (mutator.pCells) {
+      auto pCell        = mutator.pCells;
+      mutator.pCells    = pCell->pNextCell_;
+      pCell->pNextCell_ = pCells_;
+      pCells_           = pCell;
+    }
+    stats_.cells      += mutator.cells;
+    stats_.bytes      += mutator.bytes;
+    allocatedSinceGc_ += mutator.bytes;
+    mutator.cells      = 0;
+    mutator.bytes      = 0;
+  }
+
+  const GcStats& stats() const {
+    return stats_;
+  }
+
+  size_t depth() {
+    return roots().size();
+  }
+
+  void release(size_t depth) {
+    roots().resize(depth);
+  }
+
+private:
+  std::vector<Cell*>& roots() {
+    return pMutator_ ? pMutator_->stack : *pStack_;
+  }
+
+  static thread_local Mutator* pMutator_;
+
+  Cell*                 pCells_;
+  std::vector<std::pair<RootsId, Roots>> roots_;
+  RootsId               lastRoots_;
+  std::mutex            rootsMutex_;
+  std::vector<Mutator*> lent_;
+  std::vector<Cell*>    stack_;
+  std::vector<Cell*>*   pStack_;
+  std::vector<Cell*>    grey_;
+  size_t                threshold_;
+  size_t                allocatedSinceGc_;
+  GcStats               stats_;
+  bool                  log_;
+};
+
+thread_local Mutator* Gc::pMutator_ = 0;
+
+Gc gc;
+
+inline Cell::Cell() : pNextCell_(0), marked_(false) {
+  gc.track(this);
+}
+
+inline void* Cell::operator new(size_t size) {
+  gc.accountAlloc(size);
+  return ::operator new(size);
+}
+
+inline void Cell::operator delete(void* p, size_t size) {
+  gc.accountFree(size);
+  ::operator delete(p);
+}
+
+// Pops every temporary root pushed during its lifetime
+struct RootScope {
+  RootScope() : depth_(gc.depth()) {}
+  ~RootScope() { gc.release(depth_); }
+
+  size_t depth_;
+};
+
+} // namespace corvid
+
+#endif
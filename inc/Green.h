@@ -0,0 +1,425 @@
+//------------------------------------------------------------------------------
+/*
+*  
+*  The MIT License (MIT)
+* 
+*  Copyright (C) 2014 Cody Griffin (cody.m.griffin@gmail.com)
+* 
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+* 
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+* 
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*/
+
+
+
+#ifndef INCLUDED_GREEN_H
+#define INCLUDED_GREEN_H
+
+#include <deque>
+#include <memory>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+namespace corvid {
+
+//------------------------------------------------------------------------------
+/* 
+ *  Green threads: (spawn f args...) starts a task calling f, and tasks talk
+ *  over channels made with (chan [capacity]).  (send c v) waits while the
+ *  channel is full (capacity 0, the default, means until a receiver takes 
+ *  v) and (recv c) waits while it is empty.  (close c) wakes everyone 
+ *  waiting: receivers get nil, as does any later recv once the channel has
+ *  drained, and senders get an error.
+ *
+ *  Each task is a stackful coroutine with a C++ stack of its own, so it can 
+ *  block anywhere, however deep in the evaluator it is.  Tasks are switched
+ *  only when they block or (yield), and all run on the main thread: a task
+ *  that blocks hands control back to the main thread, which runs the next 
+ *  ready one.  The main thread runs tasks itself only when it would block 
+ *  on a channel or calls (yield), which runs them until none are ready.
+ *
+ *  A task keeps its own shadow stack of roots, profiler call stack and, 
+ *  under --vm, its own Vm, and switches over to them while it runs.
+ */
+struct Task : public Atom {
+  enum State {
+    READY,
+    RUNNING,
+    BLOCKED,
+    DONE,
+  };
+
+  Task(Fun* pF, Expr** ppArgs, size_t count) 
+  : Atom(TASK)
+  , pFun(pF)
+  , args(ppArgs, ppArgs + count)
+  , pValue(nil)
+  , state(READY)
+  , aborted(false)
+  , pStack(0) {
+    calls.depth = 0;
+  }
+
+  ~Task() {
+    release();
+  }
+
+  static bool is(const Expr* pExpr) {
+    return isHeap(pExpr) && pExpr->type == TASK;
+  }
+
+  void trace(Gc& gc) {
+    gc.mark(pFun);
+    for (auto pArg : args) {
+      markExpr(gc, pArg);
+    }
+    markExpr(gc, pValue);
+    for (auto pCell : roots) {
+      gc.mark(pCell);
+    }
+    if (pVm) {
+      pVm->trace(gc);
+    }
+  }
+
+  void print() {
+    std::cout << (state == DONE ? "<task done>" : "<task>");
+  }
+
+  Expr* eval (Scope* pScope) {
+    return this;
+  }
+
+  void release() {
+    if (pStack) {
+      munmap(pStack, stackSize);
+      pStack = 0;
+    }
+  }
+
+  static const size_t stackSize = 1 << 20;
+
+  Fun*                pFun;
+  std::vector<Expr*>  args;
+  Expr*               pValue;     // what it is sending or was sent
+  State               state;
+  bool                aborted;    // woken by close while sending
+
+  std::vector<Cell*>  roots;
+  std::unique_ptr<Vm> pVm;
+  CallStack           calls;
+  ucontext_t          context;
+  void*               pStack;
+};
+
+struct Chan : public Atom {
+  Chan(size_t c) 
+  : Atom(CHAN)
+  , capacity(c)
+  , closed(false) {
+  }
+
+  static bool is(const Expr* pExpr) {
+    return isHeap(pExpr) && pExpr->type == CHAN;
+  }
+
+  // Waiting tasks are rooted by the scheduler
+  void trace(Gc& gc) {
+    for (auto pItem : items) {
+      markExpr(gc, pItem);
+    }
+  }
+
+  void print() {
+    std::cout << "<chan>";
+  }
+
+  Expr* eval (Scope* pScope) {
+    return this;
+  }
+
+  bool canSend() const {
+    return closed || !receivers.empty() || items.size() < capacity;
+  }
+
+  bool canRecv() const {
+    return closed || !items.empty() || !senders.empty();
+  }
+
+  std::deque<Expr*> items;
+  std::deque<Task*> senders;
+  std::deque<Task*> receivers;
+  size_t            capacity;
+  bool              closed;
+};
+
+template <> Task* as<Task>(Expr* pExpr) { 
+  if (Task::is(pExpr)) {
+    return static_cast<Task*>(pExpr);
+  }
+
+  typeError("Type error: s-expr not a task!");
+}
+
+template <> Chan* as<Chan>(Expr* pExpr) { 
+  if (Chan::is(pExpr)) {
+    return static_cast<Chan*>(pExpr);
+  }
+
+  typeError("Type error: s-expr not a channel!");
+}
+
+template <>
+struct Unpack<Chan*> {
+  static Chan* get(Expr* pValue) {
+    return as<Chan>(pValue);
+  }
+};
+
+struct Scheduler {
+  Scheduler() 
+  : pCurrent_(0) {
+    gc.addRoots([this](Gc& gc) {
+      for (auto pTask : live_) {
+        gc.mark(pTask);
+      }
+    });
+  }
+
+  Task* spawn(Fun* pFun, Expr** ppArgs, size_t count) {
+    checkThread();
+    if (!pFun->call) {
+      throw std::runtime_error("Only functions can be spawned!");
+    }
+
+    auto pTask = new Task(pFun, ppArgs, count);
+    live_.push_back(pTask);
+    ready_.push_back(pTask);
+    return pTask;
+  }
+
+  Expr* send(Chan* pChan, Expr* pValue) {
+    checkThread();
+    for (;;) {
+      if (pChan->closed) {
+        throw std::runtime_error("Send on a closed channel!");
+      }
+
+      if (!pChan->receivers.empty()) {
+        auto pReceiver = pChan->receivers.front();
+        pChan->receivers.pop_front();
+        pReceiver->pValue = pValue;
+        wake(pReceiver);
+        return pValue;
+      }
+
+      if (pChan->items.size() < pChan->capacity) {
+        pChan->items.push_back(pValue);
+        return pValue;
+      }
+
+      if (auto pTask = pCurrent_) {
+        pTask->pValue = pValue;
+        pChan->senders.push_back(pTask);
+        park();
+        if (pTask->aborted) {
+          pTask->aborted = false;
+          throw std::runtime_error("Send on a closed channel!");
+        }
+        return pValue;
+      }
+
+      runUntil([pChan] { return pChan->canSend(); });
+    }
+  }
+
+  Expr* recv(Chan* pChan) {
+    checkThread();
+    for (;;) {
+      if (!pChan->items.empty()) {
+        auto pValue = pChan->items.front();
+        pChan->items.pop_front();
+        if (!pChan->senders.empty()) {
+          auto pSender = pChan->senders.front();
+          pChan->senders.pop_front();
+          pChan->items.push_back(pSender->pValue);
+          wake(pSender);
+        }
+        return pValue;
+      }
+
+      if (!pChan->senders.empty()) {
+        auto pSender = pChan->senders.front();
+        pChan->senders.pop_front();
+        wake(pSender);
+        return pSender->pValue;
+      }
+
+      if (pChan->closed) {
+        return nil;
+      }
+
+      if (auto pTask = pCurrent_) {
+        pTask->pValue = nil;
+        pChan->receivers.push_back(pTask);
+        park();
+        return pTask->pValue;
+      }
+
+      runUntil([pChan] { return pChan->canRecv(); });
+    }
+  }
+
+  void close(Chan* pChan) {
+    checkThread();
+    pChan->closed = true;
+    for (auto pReceiver : pChan->receivers) {
+      pReceiver->pValue = nil;
+      wake(pReceiver);
+    }
+    for (auto pSender : pChan->senders) {
+      pSender->aborted = true;
+      wake(pSender);
+    }
+    pChan->receivers.clear();
+    pChan->senders.clear();
+  }
+
+  void yield() {
+    checkThread();
+    if (auto pTask = pCurrent_) {
+      wake(pTask);
+      park();
+    } else {
+      while (runOne()) {
+      }
+    }
+  }
+
+private:
+  // The evaluator is only reentrant per thread, so tasks stay on the main one
+  void checkThread() {
+    if (gc.isWorker()) {
+      throw std::runtime_error("Tasks and channels are not for parallel code!");
+    }
+  }
+
+  void wake(Task* pTask) {
+    pTask->state = Task::READY;
+    ready_.push_back(pTask);
+  }
+
+  // Back to the main thread until something wakes the current task
+  void park() {
+    auto pTask = pCurrent_;
+    if (pTask->state == Task::RUNNING) {
+      pTask->state = Task::BLOCKED;
+    }
+    swapcontext(&pTask->context, &main_);
+  }
+
+  // The main thread has no context to park, so it runs tasks until it can go
+  template <class F>
+  void runUntil(const F& ready) {
+    while (!ready()) {
+      if (!runOne()) {
+        throw std::runtime_error("Deadlock: every task is blocked!");
+      }
+    }
+  }
+
+  // Runs the next ready task until it blocks, yields or returns
+  bool runOne() {
+    if (ready_.empty()) {
+      return false;
+    }
+
+    auto pTask = ready_.front();
+    ready_.pop_front();
+    if (!pTask->pStack) {
+      start(pTask);
+    }
+
+    pTask->state = Task::RUNNING;
+    pCurrent_    = pTask;
+    auto pStack  = gc.switchStack(&pTask->roots);
+    auto pMainVm = pVm;
+    if (pTask->pVm) {
+      pVm = pTask->pVm.get();
+    }
+    pCalls = &pTask->calls;
+
+    swapcontext(&main_, &pTask->context);
+
+    pCalls    = 0;
+    pVm       = pMainVm;
+    pCurrent_ = 0;
+    gc.switchStack(pStack);
+
+    if (pTask->state == Task::DONE) {
+      pTask->release();
+      live_.erase(std::find(live_.begin(), live_.end(), pTask));
+    }
+    return true;
+  }
+
+  void start(Task* pTask) {
+    auto pStack = mmap(0, Task::stackSize, PROT_READ | PROT_WRITE, 
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pStack == MAP_FAILED) {
+      throw std::runtime_error("Out of memory for task stacks!");
+    }
+    // A guard page, so running off the end faults instead of scribbling
+    mprotect(pStack, 4096, PROT_NONE);
+
+    pTask->pStack = pStack;
+    if (useVm) {
+      pTask->pVm.reset(new Vm(false));
+    }
+
+    getcontext(&pTask->context);
+    pTask->context.uc_stack.ss_sp   = pStack;
+    pTask->context.uc_stack.ss_size = Task::stackSize;
+    pTask->context.uc_link          = &main_;
+    makecontext(&pTask->context, &Scheduler::body, 0);
+  }
+
+  // Falling off the end resumes the main thread through uc_link
+  static void body();
+
+  std::vector<Task*> live_;
+  std::deque<Task*>  ready_;
+  Task*              pCurrent_;
+  ucontext_t         main_;
+};
+
+Scheduler scheduler;
+
+inline void Scheduler::body() {
+  auto pTask = scheduler.pCurrent_;
+  try {
+    RootScope roots;
+    pTask->pValue = pTask->pFun->call(pTask->args.data(), pTask->args.size());
+  } catch (std::exception& e) {
+    std::cerr << "Task failed: " << e.what() << std::endl;
+  }
+  pTask->state = Task::DONE;
+}
+
+} // namespace corvid
+
+#endif
@@ -0,0 +1,863 @@
+//------------------------------------------------------------------------------
+/*
+*  
+*  The MIT License (MIT)
+* 
+*  Copyright (C) 2014 Cody Griffin (cody.m.griffin@gmail.com)
+* 
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+* 
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+* 
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*/
+
+
+
+#ifndef INCLUDED_JIT_H
+#define INCLUDED_JIT_H
+
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <exception>
+
+namespace corvid {
+
+//------------------------------------------------------------------------------
+/* 
+ *  The second tier for closures made by makeLambda.  Each Lambda counts the
+ *  calls to its closures, and once it has been called threshold times its
+ *  body is lowered to LLVM IR and compiled in process.  From then on every
+ *  closure over it runs the native code, behind the same Fun.
+ *
+ *  Values are Expr* words.  Locals of the frame are loaded straight from its
+ *  slots, and calls to the integer builtins (+ - * / % = < >) are done inline 
+ *  while the global still holds the builtin and the arguments are numbers.
+ *  A call to itself in tail position rebinds the frame and loops.  A tail
+ *  call to any other lambda is handed back, as a TailCall, for the evalLoop
+ *  that ran the code to make in its place, so lambdas that call each other 
+ *  in tail position run in constant stack as they do interpreted.  Anything 
+ *  else is a call into JitRuntime.
+ *
+ *  Runtime calls that can fail catch the exception, stash it and return 0.
+ *  The compiled code returns 0 as soon as it sees one and Jit::run rethrows,
+ *  so exceptions never unwind through native frames.
+ */
+thread_local std::exception_ptr jitError;
+
+// A call compiled code made in tail position, its arguments evaluated
+struct TailCall : public Atom {
+  TailCall(Fun* pF, Expr** ppArgs, size_t count) 
+  : Atom(TAIL_CALL)
+  , pFun(pF)
+  , args(ppArgs, ppArgs + count) {
+  }
+
+  static bool is(const Expr* pExpr) {
+    return isHeap(pExpr) && pExpr->type == TAIL_CALL;
+  }
+
+  void trace(Gc& gc) {
+    gc.mark(pFun);
+    for (auto pArg : args) {
+      markExpr(gc, pArg);
+    }
+  }
+
+  void print() {
+    pFun->print();
+  }
+
+  Expr* eval(Scope* pScope) {
+    return evalLoop(this, pScope);
+  }
+
+  Fun*               pFun;
+  std::vector<Expr*> args;
+};
+
+struct JitRuntime {
+  static Expr* global(Scope* pFrame, uint64_t symbol) {
+    return pFrame->getValue(symbol);
+  }
+
+  static Expr* local(Scope* pFrame, uint64_t depth, uint64_t slot) {
+    return pFrame->getSlot(Local::box(depth, slot));
+  }
+
+  static Expr* setLocal(Scope* pFrame, uint64_t depth, uint64_t slot, 
+                        Expr* pValue) {
+    return pFrame->getSlot(Local::box(depth, slot)) = pValue;
+  }
+
+  static Expr* define(Scope* pFrame, uint64_t symbol, Expr* pValue) {
+    pFrame->setValue(symbol, pValue);
+    return pValue;
+  }
+
+  static Expr* assign(Scope* pFrame, uint64_t symbol, Expr* pValue) {
+    pFrame->assign(symbol, pValue);
+    return pValue;
+  }
+
+  static uint64_t isList(Expr* pValue) {
+    return List::is(pValue);
+  }
+
+  // 1 for functions taking evaluated arguments, 2 for forms
+  static uint64_t kind(Expr* pCallee) {
+    try {
+      return as<Fun>(pCallee)->call ? 1 : 2;
+    } catch (...) {
+      jitError = std::current_exception();
+      return 0;
+    }
+  }
+
+  static Expr* form(Fun* pCallee, List* pArgs, Scope* pFrame) {
+    try {
+      metrics().nativeCalls.bump();
+      return pCallee->fun(pArgs, pFrame);
+    } catch (...) {
+      jitError = std::current_exception();
+      return 0;
+    }
+  }
+
+  static Expr* apply(Fun* pCallee, Expr** ppArgs, uint64_t count) {
+    try {
+      metrics().nativeCalls.bump();
+      return pCallee->call(ppArgs, count);
+    } catch (...) {
+      jitError = std::current_exception();
+      return 0;
+    }
+  }
+
+  // Only calls to lambdas can go on for long enough to need handing back
+  static Expr* tailCall(Fun* pCallee, Expr** ppArgs, uint64_t count) {
+    if (!pCallee->pLambda) {
+      return apply(pCallee, ppArgs, count);
+    }
+    return new TailCall(pCallee, ppArgs, count);
+  }
+
+  static Expr* eval(Expr* pExpr, Scope* pFrame) {
+    try {
+      return evalExpr(pExpr, pFrame);
+    } catch (...) {
+      jitError = std::current_exception();
+      return 0;
+    }
+  }
+
+  static Expr* closure(Lambda* pLambda, Scope* pFrame) {
+    return makeLambda(pLambda, pFrame);
+  }
+
+  static void root(Expr* pValue) {
+    gc.root(pValue);
+  }
+
+  static uint64_t depth() {
+    return gc.depth();
+  }
+
+  // Between iterations of a self tail call only the frame is live
+  static void loop(uint64_t depth, Scope* pFrame) {
+    gc.release(depth);
+    gc.root(pFrame);
+    gc.poll();
+  }
+
+  static Scope* rebind(Fun* pSelf, Scope* pFrame, 
+                       Expr** ppArgs, uint64_t count) {
+    try {
+      auto pLambda = pSelf->pLambda;
+      checkArity(pLambda, count);
+      if (!pFrame->recyclable(pSelf->pEnv, pLambda->frameSize)) {
+        pFrame = pSelf->pEnv->extend(pLambda->frameSize);
+      }
+      auto end = std::copy(ppArgs, ppArgs + count, pFrame->slots_.begin());
+      std::fill(end, pFrame->slots_.end(), nil);
+      return pFrame;
+    } catch (...) {
+      jitError = std::current_exception();
+      return 0;
+    }
+  }
+
+  static Expr** slots(Scope* pFrame) {
+    return pFrame->slots_.data();
+  }
+};
+
+//------------------------------------------------------------------------------
+
+struct Lowering {
+  Lowering(llvm::LLVMContext& context, llvm::Module* pModule, 
+           Fun* pFun, std::vector<Cell*>& pinned) 
+  : b_      (context)
+  , pModule_(pModule)
+  , pFun_   (pFun)
+  , pinned_ (pinned)
+  , define_ (symbols.intern("define"))
+  , quote_  (symbols.intern("quote"))
+  , if_     (symbols.intern("if"))
+  , set_    (symbols.intern("set!"))
+  , begin_  (symbols.intern("begin")) {
+    i64_  = b_.getInt64Ty();
+    i64p_ = llvm::Type::getInt64PtrTy(context);
+  }
+
+  llvm::Function* lower(const std::string& name) {
+    auto pType = llvm::FunctionType::get(i64_, { i64_, i64_ }, false);
+    pFunction_ = llvm::Function::Create(pType, llvm::Function::ExternalLinkage, 
+                                        name, pModule_);
+
+    auto& context = b_.getContext();
+    pEntry_  = llvm::BasicBlock::Create(context, "entry",  pFunction_);
+    pHeader_ = llvm::BasicBlock::Create(context, "header", pFunction_);
+    pError_  = llvm::BasicBlock::Create(context, "error",  pFunction_);
+
+    b_.SetInsertPoint(pError_);
+    b_.CreateRet(b_.getInt64(0));
+
+    auto pArgs = pFunction_->arg_begin();
+    pSelf_ = &*pArgs++;
+    auto pFrame = &*pArgs;
+
+    b_.SetInsertPoint(pEntry_);
+    pDepth_ = call(&JitRuntime::depth, i64_, {});
+    auto pSlots = b_.CreateIntToPtr(call(&JitRuntime::slots, i64_, { pFrame }), 
+                                    i64p_);
+    b_.CreateBr(pHeader_);
+
+    b_.SetInsertPoint(pHeader_);
+    pFrame_ = b_.CreatePHI(i64_, 2, "frame");
+    pSlots_ = b_.CreatePHI(i64p_, 2, "slots");
+    pFrame_->addIncoming(pFrame, pEntry_);
+    pSlots_->addIncoming(pSlots, pEntry_);
+
+    if (auto pResult = lowerExpr(pFun_->pLambda->pBody, true)) {
+      b_.CreateRet(pResult);
+    }
+
+    if (llvm::verifyFunction(*pFunction_, &llvm::errs())) {
+      return 0;
+    }
+    return pFunction_;
+  }
+
+private:
+  // The value of an argument and, if it can be used by the inline integer
+  // builtins, its integer value
+  struct Operand {
+    llvm::Value* pWord;
+    llvm::Value* pIsNumber;
+    llvm::Value* pNumber;
+  };
+
+  template <typename F>
+  llvm::Value* call(F f, llvm::Type* pReturn, 
+                    std::vector<llvm::Value*> args) {
+    std::vector<llvm::Type*> types;
+    for (auto pArg : args) {
+      types.push_back(pArg->getType());
+    }
+
+    auto pType = llvm::FunctionType::get(pReturn, types, false);
+    auto pAddr = b_.CreateIntToPtr(constant(reinterpret_cast<void*>(f)), 
+                                   pType->getPointerTo());
+    return b_.CreateCall(pType, pAddr, args);
+  }
+
+  llvm::Value* constant(const void* p) {
+    return b_.getInt64(reinterpret_cast<uint64_t>(p));
+  }
+
+  llvm::BasicBlock* block(const char* name) {
+    return llvm::BasicBlock::Create(b_.getContext(), name, pFunction_);
+  }
+
+  // Argument arrays live in the entry block so a loop doesn't grow the stack
+  llvm::Value* array(size_t size) {
+    llvm::IRBuilder<> entry(pEntry_, pEntry_->begin());
+    return entry.CreateAlloca(i64_, b_.getInt64(size));
+  }
+
+  // Runtime calls that can fail return 0
+  llvm::Value* check(llvm::Value* pValue) {
+    auto pOk = block("ok");
+    b_.CreateCondBr(b_.CreateICmpEQ(pValue, b_.getInt64(0)), pError_, pOk);
+    b_.SetInsertPoint(pOk);
+    return pValue;
+  }
+
+  llvm::Value* isHeap(llvm::Value* pValue) {
+    return b_.CreateICmpEQ(b_.CreateAnd(pValue, 7), b_.getInt64(HEAP_TAG));
+  }
+
+  void root(llvm::Value* pValue) {
+    auto pRoot = block("root");
+    auto pCont = block("rooted");
+    b_.CreateCondBr(isHeap(pValue), pRoot, pCont);
+    b_.SetInsertPoint(pRoot);
+    call(&JitRuntime::root, b_.getVoidTy(), { pValue });
+    b_.CreateBr(pCont);
+    b_.SetInsertPoint(pCont);
+  }
+
+  // Constants, variables and quoted data can't run anything
+  static bool isLeaf(Expr* pExpr) {
+    if (!corvid::isHeap(pExpr)) {
+      return true;
+    }
+    if (Call::is(pExpr) || Lambda::is(pExpr) || Folded::is(pExpr)) {
+      return false;
+    }
+    return !List::is(pExpr) || !static_cast<List*>(pExpr)->pHead ||
+      (Sym::is(static_cast<List*>(pExpr)->pHead) && 
+       Sym::unbox(static_cast<List*>(pExpr)->pHead) == symbols.intern("quote"));
+  }
+
+  // Returns 0 if control left the function (or looped) instead
+  llvm::Value* lowerExpr(Expr* pExpr, bool tail) {
+    switch (tagOf(pExpr)) {
+      case SYM_TAG:
+        return lowerGlobal(Sym::unbox(pExpr));
+
+      case LOCAL_TAG:
+        if (Local::depth(pExpr) == 0) {
+          return b_.CreateLoad(i64_, slot(Local::slot(pExpr)));
+        }
+        return call(&JitRuntime::local, i64_, { 
+          pFrame_, b_.getInt64(Local::depth(pExpr)), 
+          b_.getInt64(Local::slot(pExpr)) 
+        });
+
+      case HEAP_TAG:
+        if (Lambda::is(pExpr)) {
+          return call(&JitRuntime::closure, i64_, { constant(pExpr), pFrame_ });
+        }
+        if (Call::is(pExpr)) {
+          return lowerCall(static_cast<Call*>(pExpr)->pForm, tail);
+        }
+        if (List::is(pExpr) && static_cast<List*>(pExpr)->pHead) {
+          return lowerList(static_cast<List*>(pExpr), tail);
+        }
+        if (Folded::is(pExpr)) {
+          return check(call(&JitRuntime::eval, i64_, { 
+            constant(pExpr), pFrame_ 
+          }));
+        }
+        break;
+
+      default:
+        break;
+    }
+
+    return constant(pExpr);
+  }
+
+  llvm::Value* slot(size_t index) {
+    return b_.CreateGEP(i64_, pSlots_, b_.getInt64(index));
+  }
+
+  // Globals are read through the address of their binding for as long as 
+  // nothing has been bound in an inner scope
+  llvm::Value* lowerGlobal(SymId symbol) {
+    auto ppValue = pFun_->pEnv->findGlobal(symbol);
+    if (!ppValue) {
+      return call(&JitRuntime::global, i64_, { pFrame_, b_.getInt64(symbol) });
+    }
+
+    auto pEpoch = b_.CreateLoad(i64_, 
+      b_.CreateIntToPtr(constant(&Scope::shadowEpoch), i64p_));
+    auto pFast  = block("global");
+    auto pSlow  = block("lookup");
+    auto pDone  = block("found");
+    b_.CreateCondBr(b_.CreateICmpEQ(pEpoch, b_.getInt64(Scope::shadowEpoch)), 
+                    pFast, pSlow);
+
+    b_.SetInsertPoint(pFast);
+    auto pCached = b_.CreateLoad(i64_, b_.CreateIntToPtr(constant(ppValue), 
+                                                         i64p_));
+    b_.CreateBr(pDone);
+
+    b_.SetInsertPoint(pSlow);
+    auto pLookedUp = call(&JitRuntime::global, i64_, { 
+      pFrame_, b_.getInt64(symbol) 
+    });
+    b_.CreateBr(pDone);
+
+    b_.SetInsertPoint(pDone);
+    auto pValue = b_.CreatePHI(i64_, 2);
+    pValue->addIncoming(pCached,   pFast);
+    pValue->addIncoming(pLookedUp, pSlow);
+    return pValue;
+  }
+
+  llvm::Value* lowerList(List* pList, bool tail) {
+    if (Sym::is(pList->pHead)) {
+      auto keyword = Sym::unbox(pList->pHead);
+      if (keyword == quote_) {
+        return constant(pList->get(1));
+      }
+      if (keyword == if_) {
+        return lowerIf(pList, tail);
+      }
+      if (keyword == begin_) {
+        return lowerBegin(pList, tail);
+      }
+      if ((keyword == define_ || keyword == set_) && 
+          !List::is(pList->get(1))) {
+        return lowerDefine(pList, keyword == define_);
+      }
+    }
+
+    return check(call(&JitRuntime::eval, i64_, { constant(pList), pFrame_ }));
+  }
+
+  llvm::Value* lowerIf(List* pList, bool tail) {
+    auto pCondition = lowerExpr(pList->get(1), false);
+    auto pTest = block("test");
+    auto pThen = block("then");
+    auto pElse = block("else");
+    b_.CreateCondBr(isHeap(pCondition), pTest, pThen);
+
+    b_.SetInsertPoint(pTest);
+    auto pIsList = call(&JitRuntime::isList, i64_, { pCondition });
+    b_.CreateCondBr(b_.CreateICmpNE(pIsList, b_.getInt64(0)), pElse, pThen);
+
+    std::vector<std::pair<llvm::Value*, llvm::BasicBlock*> > results;
+    b_.SetInsertPoint(pThen);
+    if (auto pValue = lowerExpr(pList->get(2), tail)) {
+      results.push_back(std::make_pair(pValue, b_.GetInsertBlock()));
+    }
+
+    b_.SetInsertPoint(pElse);
+    if (auto pValue = lowerExpr(pList->get(3), tail)) {
+      results.push_back(std::make_pair(pValue, b_.GetInsertBlock()));
+    }
+
+    return merge(results);
+  }
+
+  llvm::Value* merge(
+      const std::vector<std::pair<llvm::Value*, llvm::BasicBlock*> >& results) {
+    if (results.empty()) {
+      return 0;
+    }
+
+    auto pDone = block("merge");
+    for (auto& result : results) {
+      b_.SetInsertPoint(result.second);
+      b_.CreateBr(pDone);
+    }
+
+    b_.SetInsertPoint(pDone);
+    auto pValue = b_.CreatePHI(i64_, results.size());
+    for (auto& result : results) {
+      pValue->addIncoming(result.first, result.second);
+    }
+    return pValue;
+  }
+
+  llvm::Value* lowerBegin(List* pList, bool tail) {
+    auto pForms = pList->pTail;
+    if (!pForms || !pForms->pHead) {
+      return constant(nil);
+    }
+
+    for (; pForms->pTail && pForms->pTail->pHead; pForms = pForms->pTail) {
+      lowerExpr(pForms->pHead, false);
+    }
+    return lowerExpr(pForms->pHead, tail);
+  }
+
+  llvm::Value* lowerDefine(List* pList, bool define) {
+    auto pName  = pList->get(1);
+    auto pValue = lowerExpr(pList->get(2), false);
+
+    if (Local::is(pName) && Local::depth(pName) == 0) {
+      b_.CreateStore(pValue, slot(Local::slot(pName)));
+      return pValue;
+    }
+
+    if (Local::is(pName)) {
+      return call(&JitRuntime::setLocal, i64_, { 
+        pFrame_, b_.getInt64(Local::depth(pName)), 
+        b_.getInt64(Local::slot(pName)), pValue 
+      });
+    }
+
+    auto symbol = b_.getInt64(as<Sym>(pName));
+    if (define) {
+      return call(&JitRuntime::define, i64_, { pFrame_, symbol, pValue });
+    }
+    return call(&JitRuntime::assign, i64_, { pFrame_, symbol, pValue });
+  }
+
+  // The builtin a call site will do inline, if any
+  Fun* intrinsicFor(Expr* pHead, size_t argc) {
+    if (!Sym::is(pHead) || argc != 2) {
+      return 0;
+    }
+
+    auto ppValue = pFun_->pEnv->findGlobal(Sym::unbox(pHead));
+    if (!ppValue || !Fun::is(*ppValue)) {
+      return 0;
+    }
+
+    auto pFun = static_cast<Fun*>(*ppValue);
+    if (!pFun->intrinsic) {
+      return 0;
+    }
+
+    // The code compares against it, so it must never be freed and reused
+    pinned_.push_back(pFun);
+    return pFun;
+  }
+
+  llvm::Value* lowerCall(List* pForm, bool tail) {
+    std::vector<Expr*> args;
+    for (auto pArgs = pForm->pTail; pArgs && pArgs->pHead; 
+         pArgs = pArgs->pTail) {
+      args.push_back(pArgs->pHead);
+    }
+
+    // Anything still needed once something else has run is rooted
+    std::vector<bool> runsAfter(args.size() + 1, false);
+    for (size_t i = args.size(); i > 0; i--) {
+      runsAfter[i - 1] = runsAfter[i] || !isLeaf(args[i - 1]);
+    }
+
+    auto pIntrinsic = intrinsicFor(pForm->pHead, args.size());
+    auto pCallee    = lowerExpr(pForm->pHead, false);
+    if (runsAfter[0] && !isLeaf(pForm->pHead)) {
+      root(pCallee);
+    }
+
+    // Forms get their arguments unevaluated
+    llvm::Value* pIsIntrinsic = b_.getFalse();
+    llvm::Value* pKind;
+    if (pIntrinsic) {
+      pIsIntrinsic = b_.CreateICmpEQ(pCallee, constant(pIntrinsic));
+      auto pFrom = b_.GetInsertBlock();
+      auto pAsk  = block("kind");
+      auto pKnown = block("known");
+      b_.CreateCondBr(pIsIntrinsic, pKnown, pAsk);
+
+      b_.SetInsertPoint(pAsk);
+      auto pAsked = check(call(&JitRuntime::kind, i64_, { pCallee }));
+      auto pAskedIn = b_.GetInsertBlock();
+      b_.CreateBr(pKnown);
+
+      b_.SetInsertPoint(pKnown);
+      auto pPhi = b_.CreatePHI(i64_, 2);
+      pPhi->addIncoming(b_.getInt64(1), pFrom);
+      pPhi->addIncoming(pAsked, pAskedIn);
+      pKind = pPhi;
+    } else {
+      pKind = check(call(&JitRuntime::kind, i64_, { pCallee }));
+    }
+
+    std::vector<std::pair<llvm::Value*, llvm::BasicBlock*> > results;
+    auto pForm_ = block("form");
+    auto pArgs_ = block("args");
+    b_.CreateCondBr(b_.CreateICmpEQ(pKind, b_.getInt64(2)), pForm_, pArgs_);
+
+    b_.SetInsertPoint(pForm_);
+    auto pFormResult = check(call(&JitRuntime::form, i64_, { 
+      pCallee, constant(pForm->pTail), pFrame_ 
+    }));
+    results.push_back(std::make_pair(pFormResult, b_.GetInsertBlock()));
+
+    b_.SetInsertPoint(pArgs_);
+    std::vector<Operand> operands;
+    for (size_t i = 0; i < args.size(); i++) {
+      auto pWord = lowerExpr(args[i], false);
+      if (runsAfter[i + 1] && !isLeaf(args[i])) {
+        root(pWord);
+      }
+      operands.push_back(operand(args[i], pWord));
+    }
+
+    if (pIntrinsic) {
+      auto pInline = block("inline");
+      auto pCall   = block("call");
+      auto pOk = b_.CreateAnd(pIsIntrinsic, b_.CreateAnd(
+        operands[0].pIsNumber, operands[1].pIsNumber));
+      auto op = pIntrinsic->intrinsic;
+      if (op == INT_DIV || op == INT_MOD) {
+        pOk = b_.CreateAnd(pOk, b_.CreateICmpNE(operands[1].pNumber, 
+                                                b_.getInt32(0)));
+      }
+      b_.CreateCondBr(pOk, pInline, pCall);
+
+      b_.SetInsertPoint(pInline);
+      auto pResult = lowerIntrinsic(op, operands[0].pNumber, 
+                                    operands[1].pNumber);
+      results.push_back(std::make_pair(pResult, b_.GetInsertBlock()));
+
+      b_.SetInsertPoint(pCall);
+    }
+
+    auto pArray = array(args.size());
+    for (size_t i = 0; i < args.size(); i++) {
+      b_.CreateStore(operands[i].pWord, b_.CreateGEP(i64_, pArray, 
+                                                     b_.getInt64(i)));
+    }
+
+    if (tail) {
+      auto pLoop  = block("loop");
+      auto pApply = block("apply");
+      b_.CreateCondBr(b_.CreateICmpEQ(pCallee, pSelf_), pLoop, pApply);
+
+      b_.SetInsertPoint(pLoop);
+      auto pFrame = check(call(&JitRuntime::rebind, i64_, { 
+        pSelf_, pFrame_, pArray, b_.getInt64(args.size()) 
+      }));
+      call(&JitRuntime::loop, b_.getVoidTy(), { pDepth_, pFrame });
+      auto pSlots = b_.CreateIntToPtr(call(&JitRuntime::slots, i64_, { 
+        pFrame 
+      }), i64p_);
+      pFrame_->addIncoming(pFrame, b_.GetInsertBlock());
+      pSlots_->addIncoming(pSlots, b_.GetInsertBlock());
+      b_.CreateBr(pHeader_);
+
+      b_.SetInsertPoint(pApply);
+    }
+
+    auto pApply  = tail ? &JitRuntime::tailCall : &JitRuntime::apply;
+    auto pResult = check(call(pApply, i64_, { 
+      pCallee, pArray, b_.getInt64(args.size()) 
+    }));
+    results.push_back(std::make_pair(pResult, b_.GetInsertBlock()));
+
+    return merge(results);
+  }
+
+  // Numbers are unboxed the way as<Int> does it
+  Operand operand(Expr* pExpr, llvm::Value* pWord) {
+    Operand operand = { pWord, b_.getTrue(), 0 };
+    if (Int::is(pExpr) || Float::is(pExpr)) {
+      operand.pNumber = b_.getInt32(as<Int>(pExpr));
+      return operand;
+    }
+
+    auto pTag     = b_.CreateAnd(pWord, 7);
+    auto pPayload = b_.CreateTrunc(b_.CreateLShr(pWord, 32), b_.getInt32Ty());
+    auto pIsInt   = b_.CreateICmpEQ(pTag, b_.getInt64(INT_TAG));
+    auto pIsFloat = b_.CreateICmpEQ(pTag, b_.getInt64(FLOAT_TAG));
+    auto pFloat   = b_.CreateFPToSI(
+      b_.CreateBitCast(pPayload, b_.getFloatTy()), b_.getInt32Ty());
+
+    operand.pIsNumber = b_.CreateOr(pIsInt, pIsFloat);
+    operand.pNumber   = b_.CreateSelect(pIsInt, pPayload, pFloat);
+    return operand;
+  }
+
+  llvm::Value* lowerIntrinsic(Intrinsic op, llvm::Value* a, llvm::Value* b) {
+    llvm::Value* pTest = 0;
+    llvm::Value* pInt  = 0;
+    switch (op) {
+      case INT_ADD: pInt  = b_.CreateAdd (a, b); break;
+      case INT_SUB: pInt  = b_.CreateSub (a, b); break;
+      case INT_MUL: pInt  = b_.CreateMul (a, b); break;
+      case INT_DIV: pInt  = b_.CreateSDiv(a, b); break;
+      case INT_MOD: pInt  = b_.CreateSRem(a, b); break;
+      case INT_EQ:  pTest = b_.CreateICmpEQ (a, b); break;
+      case INT_LT:  pTest = b_.CreateICmpSLT(a, b); break;
+      case INT_GT:  pTest = b_.CreateICmpSGT(a, b); break;
+      default:      break;
+    }
+
+    if (pTest) {
+      return b_.CreateSelect(pTest, constant(Int::box(1)), constant(nil));
+    }
+
+    return b_.CreateOr(b_.CreateShl(b_.CreateZExt(pInt, i64_), 32), 
+                       b_.getInt64(INT_TAG));
+  }
+
+  llvm::IRBuilder<>   b_;
+  llvm::Module*       pModule_;
+  Fun*                pFun_;
+  std::vector<Cell*>& pinned_;
+
+  llvm::Type*         i64_;
+  llvm::Type*         i64p_;
+  llvm::Function*     pFunction_;
+  llvm::BasicBlock*   pEntry_;
+  llvm::BasicBlock*   pHeader_;
+  llvm::BasicBlock*   pError_;
+  llvm::Value*        pSelf_;
+  llvm::Value*        pDepth_;
+  llvm::PHINode*      pFrame_;
+  llvm::PHINode*      pSlots_;
+
+  SymId               define_;
+  SymId               quote_;
+  SymId               if_;
+  SymId               set_;
+  SymId               begin_;
+};
+
+//------------------------------------------------------------------------------
+
+struct Jit {
+  Jit() 
+  : threshold_(getenv("CORVID_JIT_THRESHOLD") ? 
+               atoi(getenv("CORVID_JIT_THRESHOLD")) : 1000)
+  , log_(getenv("CORVID_JIT_LOG") != 0)
+  , disabled_(false)
+  , compiled_(0) {
+  }
+
+  // Counts a call to pFun's lambda, compiling it when it gets hot
+  bool tierUp(Fun* pFun) {
+    auto pLambda = pFun->pLambda;
+    if (pLambda->compiled) {
+      return true;
+    }
+    // Nothing is compiled while other threads might be running the lambda
+    if (gc.isShared() || ++pLambda->calls != threshold_) {
+      return false;
+    }
+
+    pLambda->compiled = compile(pFun);
+    return pLambda->compiled != 0;
+  }
+
+  // The value of the call, or a TailCall still to be made
+  Expr* run(Fun* pFun, Scope* pFrame) {
+    RootScope roots;
+    gc.root(pFun);
+    gc.root(pFrame);
+    gc.poll();
+
+    auto pResult = pFun->pLambda->compiled(pFun, pFrame);
+    if (!pResult) {
+      auto error = jitError;
+      jitError   = 0;
+      std::rethrow_exception(error);
+    }
+    return pResult;
+  }
+
+private:
+  bool start() {
+    if (pJit_) {
+      return true;
+    }
+    if (disabled_) {
+      return false;
+    }
+
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    auto jit = llvm::orc::LLJITBuilder().create();
+    if (!jit) {
+      llvm::logAllUnhandledErrors(jit.takeError(), llvm::errs(), "[jit] ");
+      disabled_ = true;
+      return false;
+    }
+
+    pJit_ = std::move(*jit);
+    gc.addRoots([this](Gc& gc) {
+      for (auto pCell : pinned_) {
+        gc.mark(pCell);
+      }
+    });
+    return true;
+  }
+
+  Lambda::Compiled compile(Fun* pFun) {
+    if (!start()) {
+      return 0;
+    }
+
+    auto name     = "corvid_lambda_" + std::to_string(compiled_++);
+    auto pContext = std::make_unique<llvm::LLVMContext>();
+    auto pModule  = std::make_unique<llvm::Module>(name, *pContext);
+    pModule->setDataLayout(pJit_->getDataLayout());
+    pModule->setTargetTriple(pJit_->getTargetTriple().str());
+
+    Lowering lowering(*pContext, pModule.get(), pFun, pinned_);
+    if (!lowering.lower(name)) {
+      return 0;
+    }
+
+    optimize(*pModule);
+    if (log_) {
+      pModule->print(llvm::errs(), 0);
+    }
+
+    auto error = pJit_->addIRModule(
+      llvm::orc::ThreadSafeModule(std::move(pModule), std::move(pContext)));
+    if (error) {
+      llvm::logAllUnhandledErrors(std::move(error), llvm::errs(), "[jit] ");
+      return 0;
+    }
+
+    auto symbol = pJit_->lookup(name);
+    if (!symbol) {
+      llvm::logAllUnhandledErrors(symbol.takeError(), llvm::errs(), "[jit] ");
+      return 0;
+    }
+
+    return reinterpret_cast<Lambda::Compiled>(symbol->getAddress());
+  }
+
+  void optimize(llvm::Module& module) {
+    llvm::LoopAnalysisManager     lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager    cgam;
+    llvm::ModuleAnalysisManager   mam;
+
+    llvm::PassBuilder builder;
+    builder.registerModuleAnalyses(mam);
+    builder.registerCGSCCAnalyses(cgam);
+    builder.registerFunctionAnalyses(fam);
+    builder.registerLoopAnalyses(lam);
+    builder.crossRegisterProxies(lam, fam, cgam, mam);
+
+    builder.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2)
+      .run(module, mam);
+  }
+
+  size_t                            threshold_;
+  bool                              log_;
+  bool                              disabled_;
+  size_t                            compiled_;
+  std::unique_ptr<llvm::orc::LLJIT> pJit_;
+  std::vector<Cell*>                pinned_;
+};
+
+Jit jit;
+
+} // namespace corvid
+
+#endif
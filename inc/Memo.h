@@ -0,0 +1,233 @@
+//------------------------------------------------------------------------------
+/*
+*  
+*  The MIT License (MIT)
+* 
+*  Copyright (C) 2014 Cody Griffin (cody.m.griffin@gmail.com)
+* 
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+* 
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+* 
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*/
+
+
+
+#ifndef INCLUDED_MEMO_H
+#define INCLUDED_MEMO_H
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace corvid {
+
+//------------------------------------------------------------------------------
+/* 
+ *  (memoize f [bound] [policy]) wraps a strict function in a cache keyed on
+ *  its argument values, and (defmemo (name params...) body) defines a named
+ *  function that way, so its recursive calls go through the cache too.
+ *
+ *  Numbers, symbols, strings and lists are compared by value; vectors, arrays
+ *  and functions are mutable or opaque and are compared by identity.  Once
+ *  the cache holds bound entries (unbounded if 0) adding one evicts either
+ *  the least recently used ("lru", the default) or the oldest ("fifo").
+ *  Calls that throw are not cached.
+ */
+size_t hashExpr(Expr* pExpr) {
+  if (!isHeap(pExpr)) {
+    return std::hash<uintptr_t>()(reinterpret_cast<uintptr_t>(pExpr));
+  }
+
+  if (Str::is(pExpr)) {
+    return std::hash<std::string>()(static_cast<Str*>(pExpr)->flat());
+  }
+
+  if (List::is(pExpr)) {
+    size_t hash = 17;
+    for (auto pList = static_cast<List*>(pExpr); pList && pList->pHead; 
+         pList = pList->pTail) {
+      hash = hash * 31 + hashExpr(pList->pHead);
+    }
+    return hash;
+  }
+
+  return std::hash<Expr*>()(pExpr);
+}
+
+bool equalExpr(Expr* pA, Expr* pB) {
+  if (pA == pB) {
+    return true;
+  }
+
+  if (Str::is(pA) && Str::is(pB)) {
+    return static_cast<Str*>(pA)->flat() == static_cast<Str*>(pB)->flat();
+  }
+
+  if (List::is(pA) && List::is(pB)) {
+    auto pListA = static_cast<List*>(pA);
+    auto pListB = static_cast<List*>(pB);
+    for (; pListA && pListA->pHead && pListB && pListB->pHead; 
+         pListA = pListA->pTail, pListB = pListB->pTail) {
+      if (!equalExpr(pListA->pHead, pListB->pHead)) {
+        return false;
+      }
+    }
+    return !(pListA && pListA->pHead) && !(pListB && pListB->pHead);
+  }
+
+  return false;
+}
+
+struct Memo : public Cell {
+  typedef std::vector<Expr*> Key;
+
+  struct Hash {
+    size_t operator()(const Key& key) const {
+      size_t hash = key.size();
+      for (auto pArg : key) {
+        hash = hash * 31 + hashExpr(pArg);
+      }
+      return hash;
+    }
+  };
+
+  struct Equal {
+    bool operator()(const Key& a, const Key& b) const {
+      if (a.size() != b.size()) {
+        return false;
+      }
+      for (size_t i = 0; i < a.size(); i++) {
+        if (!equalExpr(a[i], b[i])) {
+          return false;
+        }
+      }
+      return true;
+    }
+  };
+
+  enum Policy {
+    LRU,
+    FIFO,
+  };
+
+  typedef std::list<std::pair<Key, Expr*> >                    Entries;
+  typedef std::unordered_map<Key, Entries::iterator, Hash, Equal> Index;
+
+  Memo(Fun* pF, size_t b, Policy p) 
+  : pFun(pF)
+  , bound(b)
+  , policy(p)
+  , hits(0)
+  , misses(0)
+  , evictions(0) {
+  }
+
+  void trace(Gc& gc) {
+    gc.mark(pFun);
+    for (auto& entry : entries) {
+      for (auto pArg : entry.first) {
+        markExpr(gc, pArg);
+      }
+      markExpr(gc, entry.second);
+    }
+  }
+
+  // The lock is dropped for the call itself, which may well recurse
+  Expr* call(Expr** ppArgs, size_t count) {
+    Key key(ppArgs, ppArgs + count);
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = index.find(key);
+    if (it != index.end()) {
+      hits++;
+      if (policy == LRU) {
+        entries.splice(entries.begin(), entries, it->second);
+      }
+      return it->second->second;
+    }
+
+    misses++;
+    lock.unlock();
+    auto pResult = pFun->call(ppArgs, count);
+    lock.lock();
+
+    // The call may have filled in this entry itself
+    if (index.find(key) == index.end()) {
+      if (bound && entries.size() >= bound) {
+        index.erase(entries.back().first);
+        entries.pop_back();
+        evictions++;
+      }
+      entries.push_front(std::make_pair(key, pResult));
+      index[key] = entries.begin();
+    }
+    return pResult;
+  }
+
+  Fun*    pFun;
+  size_t  bound;
+  Policy  policy;
+
+  Entries entries;
+  Index   index;
+
+  size_t  hits;
+  size_t  misses;
+  size_t  evictions;
+
+  std::mutex mutex;
+};
+
+Fun* memoize(Fun* pFun, Optional<int> maxSize, 
+             Optional<std::string> evict) {
+  if (!pFun->call) {
+    throw std::runtime_error("Only functions can be memoized!");
+  }
+  int bound = maxSize.valueOr(0);
+  if (bound < 0) {
+    throw std::runtime_error("Memo bound must not be negative!");
+  }
+
+  auto policy = evict.valueOr("lru");
+  Memo::Policy p = Memo::LRU;
+  if (policy == "fifo") {
+    p = Memo::FIFO;
+  } else if (policy != "lru") {
+    throw std::runtime_error("Unknown eviction policy!");
+  }
+
+  auto pMemo = new Memo(pFun, bound, p);
+  return Fun::strict([=](Expr** ppArgs, size_t count) {
+    return pMemo->call(ppArgs, count);
+  })->capture(pMemo);
+}
+
+// (hits misses size evictions) of a memoized function
+List* memoStats(Fun* pFun) {
+  for (auto pCell : pFun->captures_) {
+    if (auto pMemo = dynamic_cast<Memo*>(pCell)) {
+      return new List(Int::box(pMemo->hits), 
+             new List(Int::box(pMemo->misses), 
+             new List(Int::box(pMemo->entries.size()), 
+             new List(Int::box(pMemo->evictions), nil))));
+    }
+  }
+  throw std::runtime_error("Not a memoized function!");
+}
+
+} // namespace corvid
+
+#endif
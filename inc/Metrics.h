@@ -0,0 +1,361 @@
+//------------------------------------------------------------------------------
+/*
+*  
+*  The MIT License (MIT)
+* 
+*  Copyright (C) 2014 Cody Griffin (cody.m.griffin@gmail.com)
+* 
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+* 
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+* 
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*/
+
+
+#ifndef INCLUDED_METRICS_H
+#define INCLUDED_METRICS_H
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <sstream>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace corvid {
+
+//------------------------------------------------------------------------------
+/* 
+ *  Counters for what the evaluator is doing, kept all the time.
+ *
+ *  Every thread bumps a block of counters of its own, so counting is a plain
+ *  load and store with no contention; a reader sums the blocks of every 
+ *  thread that has ever counted anything.  Blocks are never freed, since the 
+ *  totals have to survive the threads that made them.
+ *
+ *  What is counted:
+ *
+ *   - objects allocated and freed, by Expr type, and scopes created and freed
+ *   - special forms dispatched by the tree walker (the VM compiles quote, if,
+ *     begin and simple defines into bytecode, so it only dispatches the rest)
+ *   - calls to natives from either evaluator or the JIT
+ *   - type errors thrown by as<>
+ *   - how many scopes Scope::getValue walked through, as a histogram
+ *   - how long each top level form took to evaluate, as a histogram
+ *
+ *  (stats) returns the totals, and if CORVID_METRICS_SOCKET names a path they
+ *  are served there in the Prometheus text format, to anything that connects
+ *  (curl --unix-socket <path> http://corvid/metrics, say).
+ */
+struct Counter {
+  Counter() : n(0) {}
+
+  // Only the owning thread writes, so this need not be an atomic add
+  void bump(uint64_t by = 1) {
+    n.store(n.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+  }
+
+  uint64_t get() const {
+    return n.load(std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> n;
+};
+
+// Bucket i counts observations below 2^i, the last one everything else
+template <size_t N>
+struct Histogram {
+  static const size_t buckets = N;
+
+  void observe(uint64_t value) {
+    size_t bucket = value ? 64 - __builtin_clzll(value) : 0;
+    if (bucket >= N) {
+      bucket = N - 1;
+    }
+    counts[bucket].bump();
+    sum.bump(value);
+  }
+
+  Counter counts[N];
+  Counter sum;
+};
+
+struct Metrics {
+  static const size_t maxTypes = 32;
+  static const size_t maxForms = 32;
+
+  Counter        allocs[maxTypes];
+  Counter        frees[maxTypes];
+  Counter        scopes;
+  Counter        freedScopes;
+  Counter        forms[maxForms];
+  Counter        nativeCalls;
+  Counter        typeErrors;
+  Histogram<9>   lookupDepth;
+  Histogram<26>  evalMicros;
+
+  Metrics*       pNext;
+};
+
+// The totals over every thread
+struct MetricsTotals {
+  MetricsTotals() {
+    memset(this, 0, sizeof(*this));
+  }
+
+  uint64_t allocs[Metrics::maxTypes];
+  uint64_t frees[Metrics::maxTypes];
+  uint64_t scopes;
+  uint64_t freedScopes;
+  uint64_t forms[Metrics::maxForms];
+  uint64_t nativeCalls;
+  uint64_t typeErrors;
+  uint64_t lookupDepth[9];
+  uint64_t lookupDepthSum;
+  uint64_t evalMicros[26];
+  uint64_t evalMicrosSum;
+};
+
+struct MetricsRegistry {
+  MetricsRegistry() : pBlocks_(0) {}
+
+  Metrics* add() {
+    auto pMetrics = new Metrics();
+    std::lock_guard<std::mutex> lock(mutex_);
+    pMetrics->pNext = pBlocks_;
+    pBlocks_        = pMetrics;
+    return pMetrics;
+  }
+
+  // Names are registered while starting up, before anything reads them
+  size_t nameForm(const std::string& name) {
+    if (forms.size() == Metrics::maxForms) {
+      throw std::runtime_error("Too many special forms to count!");
+    }
+    forms.push_back(name);
+    return forms.size() - 1;
+  }
+
+  void nameType(size_t type, const std::string& name) {
+    if (type >= types.size()) {
+      types.resize(type + 1);
+    }
+    types[type] = name;
+  }
+
+  MetricsTotals totals() {
+    MetricsTotals totals;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto p = pBlocks_; p; p = p->pNext) {
+      for (size_t i = 0; i < Metrics::maxTypes; i++) {
+        totals.allocs[i] += p->allocs[i].get();
+        totals.frees[i]  += p->frees[i].get();
+      }
+      for (size_t i = 0; i < Metrics::maxForms; i++) {
+        totals.forms[i] += p->forms[i].get();
+      }
+      for (size_t i = 0; i < p->lookupDepth.buckets; i++) {
+        totals.lookupDepth[i] += p->lookupDepth.counts[i].get();
+      }
+      for (size_t i = 0; i < p->evalMicros.buckets; i++) {
+        totals.evalMicros[i] += p->evalMicros.counts[i].get();
+      }
+      totals.scopes         += p->scopes.get();
+      totals.freedScopes    += p->freedScopes.get();
+      totals.nativeCalls    += p->nativeCalls.get();
+      totals.typeErrors     += p->typeErrors.get();
+      totals.lookupDepthSum += p->lookupDepth.sum.get();
+      totals.evalMicrosSum  += p->evalMicros.sum.get();
+    }
+    return totals;
+  }
+
+  // The Prometheus text exposition format, version 0.0.4
+  std::string exposition() {
+    auto totals = this->totals();
+    std::ostringstream out;
+
+    out << "# HELP corvid_allocations_total Objects allocated, by type.\n"
+        << "# TYPE corvid_allocations_total counter\n";
+    for (size_t i = 0; i < types.size(); i++) {
+      out << "corvid_allocations_total{type=\"" << types[i] << "\"} " 
+          << totals.allocs[i] << "\n";
+    }
+
+    out << "# HELP corvid_live_objects Objects allocated and not yet freed, "
+           "by type.\n"
+        << "# TYPE corvid_live_objects gauge\n";
+    for (size_t i = 0; i < types.size(); i++) {
+      out << "corvid_live_objects{type=\"" << types[i] << "\"} " 
+          << totals.allocs[i] - totals.frees[i] << "\n";
+    }
+
+    out << "# HELP corvid_scopes_total Scopes created.\n"
+        << "# TYPE corvid_scopes_total counter\n"
+        << "corvid_scopes_total " << totals.scopes << "\n"
+        << "# HELP corvid_live_scopes Scopes created and not yet freed.\n"
+        << "# TYPE corvid_live_scopes gauge\n"
+        << "corvid_live_scopes " << totals.scopes - totals.freedScopes << "\n";
+
+    out << "# HELP corvid_special_forms_total Special forms dispatched.\n"
+        << "# TYPE corvid_special_forms_total counter\n";
+    for (size_t i = 0; i < forms.size(); i++) {
+      out << "corvid_special_forms_total{form=\"" << escape(forms[i]) << "\"} "
+          << totals.forms[i] << "\n";
+    }
+
+    out << "# HELP corvid_native_calls_total Calls to native functions.\n"
+        << "# TYPE corvid_native_calls_total counter\n"
+        << "corvid_native_calls_total " << totals.nativeCalls << "\n"
+        << "# HELP corvid_type_errors_total Type errors thrown.\n"
+        << "# TYPE corvid_type_errors_total counter\n"
+        << "corvid_type_errors_total " << totals.typeErrors << "\n";
+
+    writeHistogram(out, "corvid_scope_lookup_depth", 
+                   "Scopes walked by each variable lookup.", 
+                   totals.lookupDepth, 9, totals.lookupDepthSum);
+    writeHistogram(out, "corvid_eval_latency_microseconds", 
+                   "Time taken to evaluate each top level form.", 
+                   totals.evalMicros, 26, totals.evalMicrosSum);
+    return out.str();
+  }
+
+  // Serves the exposition on a Unix domain socket from a thread of its own
+  void serve(const std::string& path) {
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (listener < 0 || path.size() >= sizeof(address.sun_path)) {
+      throw std::runtime_error("Couldn't serve metrics on " + path + "!");
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    unlink(path.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), 
+             sizeof(address)) < 0 || listen(listener, 8) < 0) {
+      close(listener);
+      throw std::runtime_error("Couldn't serve metrics on " + path + "!");
+    }
+
+    std::thread([this, listener]() {
+      for (;;) {
+        int client = accept(listener, 0, 0);
+        if (client < 0) {
+          continue;
+        }
+        respond(client);
+        close(client);
+      }
+    }).detach();
+  }
+
+  std::vector<std::string> types;
+  std::vector<std::string> forms;
+
+private:
+  static std::string escape(const std::string& label) {
+    std::string escaped;
+    for (auto c : label) {
+      if (c == '\\' || c == '"') {
+        escaped += '\\';
+      }
+      escaped += c;
+    }
+    return escaped;
+  }
+
+  static void writeHistogram(std::ostream& out, const char* name, 
+                             const char* help, const uint64_t* pCounts, 
+                             size_t buckets, uint64_t sum) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " histogram\n";
+    uint64_t count = 0;
+    for (size_t i = 0; i < buckets; i++) {
+      count += pCounts[i];
+      out << name << "_bucket{le=\"";
+      if (i + 1 < buckets) {
+        out << (uint64_t(1) << i) - 1;
+      } else {
+        out << "+Inf";
+      }
+      out << "\"} " << count << "\n";
+    }
+    out << name << "_sum "   << sum   << "\n"
+        << name << "_count " << count << "\n";
+  }
+
+  // Answers an HTTP GET like any other exporter, or just writes the metrics
+  // if whatever connected says nothing for a moment
+  void respond(int client) {
+    std::string request;
+    pollfd waiting = { client, POLLIN, 0 };
+    while (request.find("\r\n\r\n") == std::string::npos && 
+           poll(&waiting, 1, 100) > 0) {
+      char buffer[1024];
+      auto got = recv(client, buffer, sizeof(buffer), 0);
+      if (got <= 0) {
+        break;
+      }
+      request.append(buffer, got);
+    }
+
+    std::string body = exposition();
+    std::string reply;
+    if (request.compare(0, 4, "GET ") == 0) {
+      reply = "HTTP/1.0 200 OK\r\n"
+              "Content-Type: text/plain; version=0.0.4\r\n"
+              "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+    }
+    reply += body;
+
+    for (size_t sent = 0; sent < reply.size(); ) {
+      auto n = send(client, reply.data() + sent, reply.size() - sent, 
+                    MSG_NOSIGNAL);
+      if (n <= 0) {
+        break;
+      }
+      sent += n;
+    }
+  }
+
+  std::mutex mutex_;
+  Metrics*   pBlocks_;
+};
+
+MetricsRegistry metricsRegistry;
+
+thread_local Metrics* pThreadMetrics = 0;
+
+// This thread's counters, registered the first time it counts something
+inline Metrics& metrics() {
+  if (!pThreadMetrics) {
+    pThreadMetrics = metricsRegistry.add();
+  }
+  return *pThreadMetrics;
+}
+
+} // namespace corvid
+
+#endif
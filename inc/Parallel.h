@@ -0,0 +1,347 @@
+//------------------------------------------------------------------------------
+/*
+*  
+*  The MIT License (MIT)
+* 
+*  Copyright (C) 2014 Cody Griffin (cody.m.griffin@gmail.com)
+* 
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+* 
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+* 
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*/
+
+
+
+#ifndef INCLUDED_PARALLEL_H
+#define INCLUDED_PARALLEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace corvid {
+
+//------------------------------------------------------------------------------
+/* 
+ *  A work-stealing thread pool, started on first use with a thread per core
+ *  (or CORVID_THREADS threads).
+ *  Each worker has a deque of its own: it takes work from the back of it and,
+ *  when that runs dry, steals from the front of the others'.
+ *
+ *  run() deals a batch of tasks out across the deques and waits for all of 
+ *  them, rethrowing the first exception any of them threw.  Each worker 
+ *  allocates through a Mutator of its own (see Gc.h), which run() hands over
+ *  to the collector once the batch is done.  While the batch runs: 
+ *
+ *   - nothing is collected, since the caller is blocked in a native
+ *   - the global scope can be read but not written
+ *   - call sites are not respecialized and nothing is compiled
+ *   - each thread runs bytecode on a Vm of its own
+ *
+ *  A batch started from a worker is simply run there, in order.  submit()
+ *  queues a single task without waiting for it; it must not throw.
+ */
+struct ThreadPool {
+  typedef std::function<void()> Task;
+
+  ThreadPool() 
+  : stopping_(false)
+  , queued_(0)
+  , pending_(0)
+  , next_(0) {
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto& pWorker : workers_) {
+      pWorker->thread.join();
+    }
+  }
+
+  size_t size() {
+    start();
+    return workers_.size();
+  }
+
+  void run(std::vector<Task>& tasks) {
+    if (gc.isWorker()) {
+      for (auto& task : tasks) {
+        task();
+      }
+      return;
+    }
+
+    start();
+    pending_ = tasks.size();
+    for (size_t i = 0; i < tasks.size(); i++) {
+      auto task = std::move(tasks[i]);
+      push(i, [this, task] {
+        try {
+          task();
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          if (!error_) {
+            error_ = std::current_exception();
+          }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--pending_ == 0) {
+          done_.notify_all();
+        }
+      });
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+    for (auto& pWorker : workers_) {
+      gc.adopt(pWorker->mutator);
+    }
+
+    if (error_) {
+      auto error = error_;
+      error_     = 0;
+      std::rethrow_exception(error);
+    }
+  }
+
+  void submit(const Task& task) {
+    start();
+    push(next_++, task);
+  }
+
+private:
+  struct Worker {
+    std::mutex        mutex;
+    std::deque<Task>  tasks;
+    Mutator           mutator;
+    std::thread       thread;
+  };
+
+  void start() {
+    if (!workers_.empty()) {
+      return;
+    }
+
+    size_t count = std::max(1u, std::thread::hardware_concurrency());
+    if (auto threads = getenv("CORVID_THREADS")) {
+      count = std::max(1, atoi(threads));
+    }
+    for (size_t i = 0; i < count; i++) {
+      workers_.emplace_back(new Worker());
+    }
+    for (size_t i = 0; i < count; i++) {
+      workers_[i]->thread = std::thread([this, i] { work(i); });
+    }
+  }
+
+  void push(size_t i, const Task& task) {
+    auto& worker = *workers_[i % workers_.size()];
+    {
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      worker.tasks.push_back(task);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queued_++;
+    }
+    wake_.notify_one();
+  }
+
+  void work(size_t self) {
+    gc.attach(&workers_[self]->mutator);
+
+    for (;;) {
+      Task task;
+      if (!take(self, task)) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this] { return stopping_ || queued_ > 0; });
+        if (stopping_) {
+          return;
+        }
+        continue;
+      }
+
+      task();
+      Str::scratch().clear();
+    }
+  }
+
+  // The back of our own deque, or failing that the front of someone else's
+  bool take(size_t self, Task& task) {
+    for (size_t i = 0; i < workers_.size(); i++) {
+      auto& worker = *workers_[(self + i) % workers_.size()];
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      if (worker.tasks.empty()) {
+        continue;
+      }
+
+      if (i == 0) {
+        task = std::move(worker.tasks.back());
+        worker.tasks.pop_back();
+      } else {
+        task = std::move(worker.tasks.front());
+        worker.tasks.pop_front();
+      }
+      queued_--;
+      return true;
+    }
+    return false;
+  }
+
+  std::vector<std::unique_ptr<Worker> > workers_;
+  std::mutex                            mutex_;
+  std::condition_variable               wake_;
+  std::condition_variable               done_;
+  bool                                  stopping_;
+  std::atomic<size_t>                   queued_;
+  size_t                                pending_;
+  std::atomic<size_t>                   next_;
+  std::exception_ptr                    error_;
+};
+
+ThreadPool pool;
+
+//------------------------------------------------------------------------------
+/* 
+ *  (pmap f xs), (pfilter f xs) and (preduce f init xs) over a list or vector,
+ *  which they split into a few chunks per worker.  pmap and pfilter return 
+ *  the same kind of sequence they were given, in order.  preduce folds each 
+ *  chunk separately and then folds init and the chunk results, left to right,
+ *  so f must be associative.
+ */
+std::vector<Expr*> items(Expr* pSeq) {
+  if (Vector::is(pSeq)) {
+    return static_cast<Vector*>(pSeq)->items;
+  }
+
+  std::vector<Expr*> result;
+  for (auto pList = as<List>(pSeq); pList->pTail; pList = pList->pTail) {
+    result.push_back(pList->pHead);
+  }
+  return result;
+}
+
+Expr* sequence(Expr* pLike, const std::vector<Expr*>& result) {
+  if (Vector::is(pLike)) {
+    auto pVector   = new Vector();
+    pVector->items = result;
+    return pVector;
+  }
+
+  auto pList = nil;
+  for (auto it = result.rbegin(); it != result.rend(); ++it) {
+    pList = new List(*it, pList);
+  }
+  return pList;
+}
+
+typedef std::function<void(size_t chunk, size_t begin, size_t end)> Chunk;
+
+size_t chunksFor(size_t count) {
+  return std::min(count, pool.size() * 4);
+}
+
+// Calls body on consecutive, non-empty chunks of [0, count) in parallel
+void forChunks(size_t count, const Chunk& body) {
+  auto chunks = chunksFor(count);
+  std::vector<ThreadPool::Task> tasks;
+  for (size_t i = 0; i < chunks; i++) {
+    auto begin = count * i / chunks;
+    auto end   = count * (i + 1) / chunks;
+    tasks.push_back([=, &body] { body(i, begin, end); });
+  }
+  pool.run(tasks);
+}
+
+void checkStrict(Fun* pFun) {
+  if (!pFun->call) {
+    throw std::runtime_error("Parallel functions must be strict!");
+  }
+}
+
+Expr* pmap(Fun* pFun, Expr* pSeq) {
+  checkStrict(pFun);
+  auto input = items(pSeq);
+  std::vector<Expr*> result(input.size());
+  forChunks(input.size(), [&](size_t, size_t begin, size_t end) {
+    for (auto i = begin; i < end; i++) {
+      result[i] = pFun->call(&input[i], 1);
+    }
+  });
+  return sequence(pSeq, result);
+}
+
+Expr* pfilter(Fun* pFun, Expr* pSeq) {
+  checkStrict(pFun);
+  auto input = items(pSeq);
+  std::vector<char> keep(input.size());
+  forChunks(input.size(), [&](size_t, size_t begin, size_t end) {
+    for (auto i = begin; i < end; i++) {
+      keep[i] = pFun->call(&input[i], 1) != nil;
+    }
+  });
+
+  std::vector<Expr*> result;
+  for (size_t i = 0; i < input.size(); i++) {
+    if (keep[i]) {
+      result.push_back(input[i]);
+    }
+  }
+  return sequence(pSeq, result);
+}
+
+Expr* preduce(Fun* pFun, Expr* pInit, Expr* pSeq) {
+  checkStrict(pFun);
+  auto input  = items(pSeq);
+  std::vector<Expr*> partial(chunksFor(input.size()));
+  forChunks(input.size(), [&](size_t chunk, size_t begin, size_t end) {
+    Expr* ppArgs[2] = { input[begin], 0 };
+    RootScope roots;
+    for (auto i = begin + 1; i < end; i++) {
+      ppArgs[1] = input[i];
+      ppArgs[0] = rootExpr(pFun->call(ppArgs, 2));
+    }
+    partial[chunk] = ppArgs[0];
+  });
+
+  RootScope roots;
+  auto pAcc = pInit;
+  for (auto pPartial : partial) {
+    rootExpr(pPartial);
+  }
+  for (auto pPartial : partial) {
+    Expr* ppArgs[2] = { pAcc, pPartial };
+    pAcc = rootExpr(pFun->call(ppArgs, 2));
+  }
+  return pAcc;
+}
+
+} // namespace corvid
+
+#endif
@@ -32,18 +32,121 @@
 #include <list>
 #include <memory>
 #include <stdexcept>
+#include <functional>
 
 #include <sstream>
+#include <vector>
 
 //------------------------------------------------------------------------------
 
 typedef std::string::iterator StrIt;
 
+//------------------------------------------------------------------------------
+/* 
+ *  ParseArena is a bump allocator that owns every ParseNode created while it
+ *  is active.  A tree is thrown away all at once with reset(), which keeps the
+ *  arena's blocks around for the next parse, so steady-state parsing never 
+ *  touches the system allocator.
+ */
+struct ParseArena {
+  ParseArena(size_t blockSize = 64 << 10) 
+  : blockSize_(blockSize)
+  , block_(0)
+  , pPos_(0)
+  , pEnd_(0) {
+  }
+
+  ~ParseArena() {
+    for (auto pBlock : blocks_) {
+      ::operator delete(pBlock.first);
+    }
+  }
+
+  void* allocate(size_t size) {
+    size = (size + alignment - 1) & ~(alignment - 1);
+    while (pPos_ + size > pEnd_) {
+      nextBlock(size);
+    }
+
+    void* p = pPos_;
+    pPos_  += size;
+    return p;
+  }
+
+  // Release everything at once, nodes are never destroyed individually
+  void reset() {
+    block_ = 0;
+    pPos_  = pEnd_ = 0;
+  }
+
+  // Arenas nest, the most recently activated one receives new nodes
+  struct Use {
+    Use(ParseArena& arena) : pPrevious_(pActive) { pActive = &arena; }
+    ~Use()                                       { pActive = pPrevious_; }
+
+    ParseArena* pPrevious_;
+  };
+
+  static ParseArena& active() {
+    static ParseArena fallback;
+    return pActive ? *pActive : fallback;
+  }
+
+  static const size_t alignment = 16;
+  static ParseArena*  pActive;
+
+private:
+  void nextBlock(size_t size) {
+    if (block_ < blocks_.size() && blocks_[block_].second >= size) {
+      pPos_ = static_cast<char*>(blocks_[block_].first);
+      pEnd_ = pPos_ + blocks_[block_].second;
+      block_++;
+      return;
+    }
+
+    // Oversized requests get a block of their own, inserted where we are
+    auto length = size > blockSize_ ? size : blockSize_;
+    auto pBlock = ::operator new(length);
+    blocks_.insert(blocks_.begin() + block_, std::make_pair(pBlock, length));
+    pPos_ = static_cast<char*>(pBlock);
+    pEnd_ = pPos_ + length;
+    block_++;
+  }
+
+  std::vector<std::pair<void*, size_t>> blocks_;
+  size_t                                blockSize_;
+  size_t                                block_;
+  char*                                 pPos_;
+  char*                                 pEnd_;
+};
+
+ParseArena* ParseArena::pActive = 0;
+
+// The text a node matched, as a view into the input rather than a copy.  It is
+// only valid for as long as the input string is.
+struct Match {
+  Match() {}
+  Match(StrIt first, StrIt last) : first_(first), last_(last) {}
+
+  StrIt       begin()  const { return first_; }
+  StrIt       end()    const { return last_; }
+  size_t      size()   const { return last_ - first_; }
+  std::string str()    const { return std::string(first_, last_); }
+
+  StrIt first_;
+  StrIt last_;
+};
+
+inline std::ostream& operator<<(std::ostream& os, const Match& match) {
+  return os.write(&*match.begin(), match.size());
+}
+
 //------------------------------------------------------------------------------
 /* 
  *  ParseNode represents a node in the resulting Abstract Syntax Tree.  
  *
- *  Currently, ASTs are binary trees (With Left and Right subtrees)
+ *  Currently, ASTs are binary trees (With Left and Right subtrees).  Nodes
+ *  are allocated from the active ParseArena, which owns them.
  */
 struct ParseNode {
   enum Position {
@@ -56,7 +159,7 @@ struct ParseNode {
   static const int noContext = -1;
 
   // Construct an empty ParseNode
-  ParseNode(const std::string& m = "", ParseNode* pL = 0, ParseNode* pR = 0) 
+  ParseNode(const Match& m = Match(), ParseNode* pL = 0, ParseNode* pR = 0) 
   : match(m)
   , context(noContext)
   , position(UNKNOWN)
@@ -64,10 +167,18 @@ struct ParseNode {
   , pLeft(pL)
   , pRight(pR)
   {}
+
+  static void* operator new(size_t size) {
+    return ParseArena::active().allocate(size);
+  }
+
+  // Freed when the arena is reset
+  static void operator delete(void* p) {
+  }
     
   void terminate() {
-    pLeft.reset(0);
-    pRight.reset(0);
+    pLeft  = 0;
+    pRight = 0;
   }
   
   bool hasContext() {
@@ -76,8 +187,8 @@ struct ParseNode {
 
   void fillContext() {
     if (hasContext()) {
-      fillContext(pLeft.get());
-      fillContext(pRight.get());
+      fillContext(pLeft);
+      fillContext(pRight);
     }
   }
 
@@ -100,13 +211,13 @@ struct ParseNode {
               << std::string(4, ' ') << std::string(2*depth, '-') 
               << " "                 << match << std::endl;
 
-    if (pLeft.get())  pLeft->print(depth+1, LEFT);
-    if (pRight.get()) pRight->print(depth+1, RIGHT);
+    if (pLeft)  pLeft->print(depth+1, LEFT);
+    if (pRight) pRight->print(depth+1, RIGHT);
   }
 
   ParseNode* getLeft() const {
-    if (pLeft.get()) {
-      return pLeft.get(); 
+    if (pLeft) {
+      return pLeft; 
     }
   
     throw std::runtime_error("ParseNode has no Left");
@@ -114,8 +225,8 @@ struct ParseNode {
   }
 
   ParseNode* getRight() const {
-    if (pRight.get()) {
-      return pRight.get();
+    if (pRight) {
+      return pRight;
     }
 
     throw std::runtime_error("ParseNode has no Right");
@@ -132,13 +243,13 @@ private:
   }
 
 public:
-  std::string                match;
+  Match                      match;
   int                        context;
   int                        position;
   int                        indirection;
 
-  std::unique_ptr<ParseNode> pLeft;
-  std::unique_ptr<ParseNode> pRight;
+  ParseNode*                 pLeft;
+  ParseNode*                 pRight;
 };
 
 // A Parser is any function that takes string iterators and returns a ParseNode
@@ -189,21 +300,6 @@ struct Rule {
     return pNode;
   }
 
-  ParseNode* parse(const char* pText) const {
-    std::string temp(pText);
-    auto first = temp.begin();
-    auto last  = temp.end();
-    ParseNode* pNode = parse_(first, last);
-    if (pNode) { 
-      pNode->context = context_;
-      pNode->fillContext();
-      if (terminal_) {
-        pNode->terminate();
-      }
-    }
-    return pNode;
-  }
-
   Parser  parse_;
   int     context_;
   bool    terminal_;
@@ -234,11 +330,11 @@ void error(const std::string& match, const std::string& context) {
 static Rule 
 range(char a, char b) {
   return Rule([=](StrIt& first, StrIt& last) -> ParseNode* {
-    auto match = std::string(first, std::next(first));
+    auto match = Match(first, std::next(first));
     if (*first >= a && *first <= b) {
       std::advance(first, 1);
     } else {
-      error(match, "parse");
+      error(match.str(), "parse");
     }
     return new ParseNode(match);
   });
@@ -247,11 +343,11 @@ range(char a, char b) {
 static Rule 
 lit(char c) {
   return Rule([=](StrIt& first, StrIt& last) -> ParseNode* {
-    auto match = std::string(first, std::next(first));
+    auto match = Match(first, std::next(first));
     if (*first == c) {
       std::advance(first, 1);
     } else {
-      error(match, "parse");
+      error(match.str(), "parse");
     }
     return new ParseNode(match);
   });
@@ -260,11 +356,11 @@ lit(char c) {
 static Rule 
 lit(const std::string& str) {
   return Rule([=](StrIt& first, StrIt& last) -> ParseNode* {
-    auto match = std::string(first, std::next(first, str.length()));
-    if (match == str) {
+    auto match = Match(first, std::next(first, str.length()));
+    if (match.str() == str) {
       std::advance(first, str.length());
     } else {
-      error(match, "parse");
+      error(match.str(), "parse");
     }
     return new ParseNode(match);
   });
@@ -273,7 +369,7 @@ lit(const std::string& str) {
 static Rule 
 any(const std::string& str) {
   return Rule([=](StrIt& first, StrIt& last) -> ParseNode* {
-    auto match = std::string(first, std::next(first));
+    auto match = Match(first, std::next(first));
     for (auto c : str) {
       if (*first == c) {
         std::advance(first, 1);
@@ -281,7 +377,7 @@ any(const std::string& str) {
       }
     }
 
-    error(match, "parse");
+    error(match.str(), "parse");
     return 0;
   });
 };
@@ -304,9 +400,9 @@ Rule seq(const Rule& a, const Rule& b) {
     auto original = first;
     try {
       ParseNode* pNode = new ParseNode(); 
-      pNode->pLeft.reset (a.parse(first, last));
-      pNode->pRight.reset(b.parse(first, last));
-      pNode->match = std::string(original, first);
+      pNode->pLeft  = a.parse(first, last);
+      pNode->pRight = b.parse(first, last);
+      pNode->match  = Match(original, first);
       return pNode;
     }
     catch (std::exception& e) {
@@ -323,15 +419,15 @@ Rule alt(const Rule& a, const Rule& b) {
     auto original = first;
     try {
       ParseNode* pNode = new ParseNode(); 
-      pNode->pLeft.reset(a.parse(first, last));
-      pNode->match = std::string(original, first);
+      pNode->pLeft = a.parse(first, last);
+      pNode->match = Match(original, first);
       return pNode;
     }
     catch (std::exception& e) {
       first = original;
       ParseNode* pNode = new ParseNode(); 
-      pNode->pRight.reset(b.parse(first, last));
-      pNode->match = std::string(original, first);
+      pNode->pRight = b.parse(first, last);
+      pNode->match  = Match(original, first);
       return pNode;
     }
   };
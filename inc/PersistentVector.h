@@ -0,0 +1,372 @@
+//------------------------------------------------------------------------------
+/*
+*  
+*  The MIT License (MIT)
+* 
+*  Copyright (C) 2014 Cody Griffin (cody.m.griffin@gmail.com)
+* 
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+* 
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+* 
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*/
+
+
+
+#ifndef INCLUDED_PERSISTENTVECTOR_H
+#define INCLUDED_PERSISTENTVECTOR_H
+
+#include <atomic>
+
+namespace corvid {
+
+//------------------------------------------------------------------------------
+/* 
+ *  An immutable vector that shares structure between versions, after 
+ *  Clojure's.  Items live in a trie of 32-way nodes, indexed five bits per
+ *  level, except the last (up to) 32, which are kept in a separate tail 
+ *  node so that conj usually copies just the tail.  Reading, assoc and conj
+ *  touch one node per level, so they are O(log32 n) and copy no more than
+ *  that path.
+ *
+ *  A Transient is a mutable, single owner version used to build or update 
+ *  a vector in bulk.  Nodes remember the edit id of the transient that made 
+ *  them, and a transient updates its own nodes in place instead of copying 
+ *  them.  persistent! ends the edit, so nodes it made are never touched 
+ *  again and can be shared.
+ */
+const size_t pvecBits  = 5;
+const size_t pvecWidth = 1 << pvecBits;
+const size_t pvecMask  = pvecWidth - 1;
+
+struct PNode : public Cell {
+  PNode(bool l, uint64_t e) : leaf(l), edit(e) {
+    std::fill(children, children + pvecWidth, (PNode*)0);
+  }
+
+  PNode(const PNode& other, uint64_t e) : Cell(), leaf(other.leaf), edit(e) {
+    std::copy(other.children, other.children + pvecWidth, children);
+  }
+
+  void trace(Gc& gc) {
+    for (size_t i = 0; i < pvecWidth; i++) {
+      if (leaf) {
+        markExpr(gc, items[i]);
+      } else {
+        gc.mark(children[i]);
+      }
+    }
+  }
+
+  bool     leaf;
+  uint64_t edit;
+  union {
+    PNode* children[pvecWidth];
+    Expr*  items   [pvecWidth];
+  };
+};
+
+// The trie operations shared by PVec and Transient.  Nodes are copied 
+// unless they belong to the current edit (0 for persistent updates).
+struct PTrie {
+  PTrie() 
+  : count(0)
+  , shift(pvecBits)
+  , pRoot(new PNode(false, 0))
+  , pTail(new PNode(true, 0)) {
+  }
+
+  size_t tailOffset() const {
+    return count < pvecWidth ? 0 : ((count - 1) >> pvecBits) << pvecBits;
+  }
+
+  void check(int index) const {
+    if (index < 0 || size_t(index) >= count) {
+      throw std::runtime_error("Index out of range!");
+    }
+  }
+
+  PNode* leafFor(size_t index) const {
+    if (index >= tailOffset()) {
+      return pTail;
+    }
+
+    auto pNode = pRoot;
+    for (auto level = shift; level > 0; level -= pvecBits) {
+      pNode = pNode->children[(index >> level) & pvecMask];
+    }
+    return pNode;
+  }
+
+  Expr* get(int index) const {
+    check(index);
+    return leafFor(index)->items[index & pvecMask];
+  }
+
+  static PNode* editable(PNode* pNode, uint64_t edit) {
+    if (edit && pNode->edit == edit) {
+      return pNode;
+    }
+    return new PNode(*pNode, edit);
+  }
+
+  void conj(Expr* pValue, uint64_t edit) {
+    auto room = count - tailOffset();
+    if (room < pvecWidth) {
+      pTail = editable(pTail, edit);
+      pTail->items[room] = pValue;
+      count++;
+      return;
+    }
+
+    // The tail is full, so it moves into the trie, which may need a new level
+    if ((count >> pvecBits) > (size_t(1) << shift)) {
+      auto pNewRoot = new PNode(false, edit);
+      pNewRoot->children[0] = pRoot;
+      pNewRoot->children[1] = newPath(shift, pTail, edit);
+      pRoot  = pNewRoot;
+      shift += pvecBits;
+    } else {
+      pRoot = pushTail(shift, pRoot, pTail, edit);
+    }
+
+    pTail = new PNode(true, edit);
+    pTail->items[0] = pValue;
+    count++;
+  }
+
+  void assoc(int index, Expr* pValue, uint64_t edit) {
+    check(index);
+    if (size_t(index) >= tailOffset()) {
+      pTail = editable(pTail, edit);
+      pTail->items[index & pvecMask] = pValue;
+      return;
+    }
+    pRoot = assocPath(shift, pRoot, index, pValue, edit);
+  }
+
+  size_t count;
+  size_t shift;
+  PNode* pRoot;
+  PNode* pTail;
+
+private:
+  PNode* pushTail(size_t level, PNode* pParent, PNode* pLeaf, uint64_t edit) {
+    auto pNode = editable(pParent, edit);
+    auto index = ((count - 1) >> level) & pvecMask;
+    if (level == pvecBits) {
+      pNode->children[index] = pLeaf;
+    } else if (auto pChild = pParent->children[index]) {
+      pNode->children[index] = pushTail(level - pvecBits, pChild, pLeaf, edit);
+    } else {
+      pNode->children[index] = newPath(level - pvecBits, pLeaf, edit);
+    }
+    return pNode;
+  }
+
+  static PNode* newPath(size_t level, PNode* pLeaf, uint64_t edit) {
+    if (level == 0) {
+      return pLeaf;
+    }
+    auto pNode = new PNode(false, edit);
+    pNode->children[0] = newPath(level - pvecBits, pLeaf, edit);
+    return pNode;
+  }
+
+  static PNode* assocPath(size_t level, PNode* pParent, size_t index, 
+                          Expr* pValue, uint64_t edit) {
+    auto pNode = editable(pParent, edit);
+    if (level == 0) {
+      pNode->items[index & pvecMask] = pValue;
+    } else {
+      auto slot = (index >> level) & pvecMask;
+      pNode->children[slot] = assocPath(level - pvecBits, pParent->children[slot],
+                                        index, pValue, edit);
+    }
+    return pNode;
+  }
+};
+
+struct PVec : public Atom {
+  PVec() : Atom(PVEC) {}
+  PVec(const PTrie& t) : Atom(PVEC), trie(t) {}
+
+  static bool is(const Expr* pExpr) {
+    return isHeap(pExpr) && pExpr->type == PVEC;
+  }
+
+  void trace(Gc& gc) {
+    gc.mark(trie.pRoot);
+    gc.mark(trie.pTail);
+  }
+
+  void print() {
+    std::cout << "#[ ";
+    for (size_t i = 0; i < trie.count; i++) {
+      printExpr(trie.get(i));
+      std::cout << " ";
+    }
+    std::cout << "]";
+  }
+
+  Expr* eval (Scope* pScope) {
+    return this;
+  }
+
+  PVec* conj(Expr* pValue) const {
+    auto pVec = new PVec(trie);
+    pVec->trie.conj(pValue, 0);
+    return pVec;
+  }
+
+  PVec* assoc(int index, Expr* pValue) const {
+    auto pVec = new PVec(trie);
+    if (size_t(index) == trie.count) {
+      pVec->trie.conj(pValue, 0);
+    } else {
+      pVec->trie.assoc(index, pValue, 0);
+    }
+    return pVec;
+  }
+
+  PTrie trie;
+};
+
+struct Transient : public Atom {
+  Transient(const PTrie& t) 
+  : Atom(TRANSIENT)
+  , trie(t)
+  , edit(++lastEdit) {
+  }
+
+  static bool is(const Expr* pExpr) {
+    return isHeap(pExpr) && pExpr->type == TRANSIENT;
+  }
+
+  void trace(Gc& gc) {
+    gc.mark(trie.pRoot);
+    gc.mark(trie.pTail);
+  }
+
+  void print() {
+    std::cout << "<transient>";
+  }
+
+  Expr* eval (Scope* pScope) {
+    return this;
+  }
+
+  void checkEditable() const {
+    if (!edit) {
+      throw std::runtime_error("Transient used after persistent!");
+    }
+  }
+
+  Transient* conj(Expr* pValue) {
+    checkEditable();
+    trie.conj(pValue, edit);
+    return this;
+  }
+
+  Transient* assoc(int index, Expr* pValue) {
+    checkEditable();
+    if (size_t(index) == trie.count) {
+      trie.conj(pValue, edit);
+    } else {
+      trie.assoc(index, pValue, edit);
+    }
+    return this;
+  }
+
+  PVec* persistent() {
+    checkEditable();
+    edit = 0;
+    return new PVec(trie);
+  }
+
+  PTrie    trie;
+  uint64_t edit;
+
+  static std::atomic<uint64_t> lastEdit;
+};
+
+std::atomic<uint64_t> Transient::lastEdit(0);
+
+template <> PVec* as<PVec>(Expr* pExpr) { 
+  if (PVec::is(pExpr)) {
+    return static_cast<PVec*>(pExpr);
+  }
+
+  typeError("Type error: s-expr not a persistent vector!");
+}
+
+template <> Transient* as<Transient>(Expr* pExpr) { 
+  if (Transient::is(pExpr)) {
+    return static_cast<Transient*>(pExpr);
+  }
+
+  typeError("Type error: s-expr not a transient!");
+}
+
+template <>
+struct Unpack<PVec*> {
+  static PVec* get(Expr* pValue) {
+    return pValue ? as<PVec>(pValue) : new PVec();
+  }
+};
+
+template <>
+struct Unpack<Transient*> {
+  static Transient* get(Expr* pValue) {
+    return as<Transient>(pValue);
+  }
+};
+
+// Conjoins the items of a list, vector or persistent vector onto pVec
+PVec* into(PVec* pVec, Expr* pItems) {
+  RootScope roots;
+  auto pTransient = new Transient(pVec->trie);
+  gc.root(pTransient);
+
+  if (List::is(pItems)) {
+    for (auto pList = static_cast<List*>(pItems); pList->pTail; 
+         pList = pList->pTail) {
+      pTransient->conj(pList->pHead);
+    }
+  } else if (Vector::is(pItems)) {
+    for (auto pItem : static_cast<Vector*>(pItems)->items) {
+      pTransient->conj(pItem);
+    }
+  } else {
+    auto& trie = as<PVec>(pItems)->trie;
+    for (size_t i = 0; i < trie.count; i++) {
+      pTransient->conj(trie.get(i));
+    }
+  }
+  return pTransient->persistent();
+}
+
+List* pvecToList(PVec* pVec) {
+  auto pList = nil;
+  for (size_t i = pVec->trie.count; i > 0; i--) {
+    pList = new List(pVec->trie.get(i - 1), pList);
+  }
+  return pList;
+}
+
+} // namespace corvid
+
+#endif
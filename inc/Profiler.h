@@ -0,0 +1,288 @@
+//------------------------------------------------------------------------------
+/*
+*  
+*  The MIT License (MIT)
+* 
+*  Copyright (C) 2014 Cody Griffin (cody.m.griffin@gmail.com)
+* 
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+* 
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+* 
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*/
+
+
+
+#ifndef INCLUDED_PROFILER_H
+#define INCLUDED_PROFILER_H
+
+#include <atomic>
+#include <csignal>
+#include <fstream>
+#include <sys/time.h>
+
+namespace corvid {
+
+//------------------------------------------------------------------------------
+/* 
+ *  A sampling profiler.  (profile expr [file]) evaluates expr with a CPU
+ *  timer ticking every millisecond.  Each tick copies the interrupted 
+ *  thread's shadow call stack (the names of the functions it is in) into a
+ *  preallocated buffer.  When expr is done it returns a table of
+ *  (name self-ms total-ms), most self time first, and if given a file it
+ *  writes the samples there as collapsed stacks for flamegraph.pl.
+ *
+ *  The evaluators push a function's name on the way into its body (a tail
+ *  call replaces the caller's) and put the depth back on the way out, but
+ *  only push while profiling.  Natives don't appear; their time is the 
+ *  caller's.
+ */
+struct CallStack {
+  static const size_t maxDepth = 128;
+
+  // Deeper calls are counted but not recorded
+  Expr*  frames[maxDepth];
+  size_t depth;
+};
+
+// Plain, zero-initialized thread locals, safe to read from a signal handler.
+// Green threads switch pCalls to a stack of their own; 0 means this one.
+thread_local CallStack  threadCalls;
+thread_local CallStack* pCalls;
+
+inline CallStack& calls() {
+  return pCalls ? *pCalls : threadCalls;
+}
+
+std::atomic<bool> profiling(false);
+
+// What anonymous functions are called, interned when profiling starts
+Expr* pAnonymous;
+
+// Records pFun as the call at depth, replacing whatever was there
+inline void pushCall(CallStack& stack, size_t depth, Fun* pFun) {
+  if (depth < CallStack::maxDepth) {
+    stack.frames[depth] = pFun->pName ? pFun->pName : pAnonymous;
+  }
+  std::atomic_signal_fence(std::memory_order_release);
+  stack.depth = depth + 1;
+}
+
+// Records one call level for the lifetime of an evaluator frame
+struct CallFrame {
+  CallFrame() 
+  : stack_(calls())
+  , depth_(stack_.depth)
+  , pushed_(false) {
+  }
+
+  ~CallFrame() {
+    stack_.depth = depth_;
+  }
+
+  void enter(Fun* pFun) {
+    if (!profiling.load(std::memory_order_relaxed)) {
+      return;
+    }
+
+    if (!pushed_) {
+      depth_  = stack_.depth;
+      pushed_ = true;
+    }
+    pushCall(stack_, depth_, pFun);
+  }
+
+  CallStack& stack_;
+  size_t     depth_;
+  bool       pushed_;
+};
+
+struct Profiler {
+  static const size_t bufferSize = 1 << 22;
+  static const int    interval   = 1000;    // microseconds
+
+  Profiler() 
+  : used_(0)
+  , dropped_(0) {
+  }
+
+  void start() {
+    if (profiling) {
+      throw std::runtime_error("Already profiling!");
+    }
+
+    buffer_.assign(bufferSize, nil);
+    used_      = 0;
+    dropped_   = 0;
+    pAnonymous = Sym::intern("<lambda>");
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &Profiler::onTick;
+    action.sa_flags   = SA_RESTART;
+    sigaction(SIGPROF, &action, &previous_);
+
+    profiling = true;
+    setTimer(interval);
+  }
+
+  void stop() {
+    setTimer(0);
+    profiling = false;
+    sigaction(SIGPROF, &previous_, 0);
+  }
+
+  // (name self-ms total-ms) for every function seen, most self time first
+  List* table() {
+    std::map<Expr*, std::pair<size_t, size_t> > times;
+    each([&](Expr** ppFrames, size_t depth) {
+      std::vector<Expr*> seen;
+      for (size_t i = 0; i < depth; i++) {
+        if (std::find(seen.begin(), seen.end(), ppFrames[i]) == seen.end()) {
+          seen.push_back(ppFrames[i]);
+          times[ppFrames[i]].second++;
+        }
+      }
+      times[depth ? ppFrames[depth - 1] : Sym::intern("<top>")].first++;
+    });
+
+    std::vector<std::pair<Expr*, std::pair<size_t, size_t> > > rows(
+      times.begin(), times.end());
+    std::stable_sort(rows.begin(), rows.end(), [](
+      const std::pair<Expr*, std::pair<size_t, size_t> >& a, 
+      const std::pair<Expr*, std::pair<size_t, size_t> >& b) {
+      return a.second.first > b.second.first;
+    });
+
+    double ms   = interval / 1000.0;
+    auto pTable = nil;
+    for (auto it = rows.rbegin(); it != rows.rend(); ++it) {
+      auto pRow = new List(it->first, 
+                  new List(Float::box(it->second.first * ms), 
+                  new List(Float::box(it->second.second * ms), nil)));
+      pTable = new List(pRow, pTable);
+    }
+    return pTable;
+  }
+
+  // One line per distinct stack, outermost first: "a;b;c count"
+  void writeCollapsed(const std::string& path) {
+    std::map<std::string, size_t> stacks;
+    each([&](Expr** ppFrames, size_t depth) {
+      std::string stack = "<top>";
+      for (size_t i = 0; i < depth; i++) {
+        stack += ";" + Sym::name(ppFrames[i]);
+      }
+      stacks[stack]++;
+    });
+
+    std::ofstream out(path);
+    if (!out) {
+      throw std::runtime_error("Couldn't write profile to " + path + "!");
+    }
+    for (auto& stack : stacks) {
+      out << stack.first << " " << stack.second << "\n";
+    }
+  }
+
+  size_t dropped() const {
+    return dropped_;
+  }
+
+private:
+  static void setTimer(int usec) {
+    itimerval timer;
+    timer.it_interval.tv_sec  = 0;
+    timer.it_interval.tv_usec = usec;
+    timer.it_value            = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, 0);
+  }
+
+  static void onTick(int);
+
+  // Calls f(frames, depth) for every sample recorded
+  template <class F>
+  void each(const F& f) {
+    auto end = std::min<size_t>(used_, buffer_.size());
+    for (size_t at = 0; at < end && Int::is(buffer_[at]); ) {
+      size_t depth = Int::unbox(buffer_[at]);
+      if (at + 1 + depth > end) {
+        break;
+      }
+      f(&buffer_[at + 1], depth);
+      at += depth + 1;
+    }
+  }
+
+  std::vector<Expr*>  buffer_;
+  std::atomic<size_t> used_;
+  std::atomic<size_t> dropped_;
+  struct sigaction    previous_;
+};
+
+Profiler profiler;
+
+// Runs on whichever thread the timer interrupted
+inline void Profiler::onTick(int) {
+  if (!profiling) {
+    return;
+  }
+
+  auto&  stack = calls();
+  size_t depth = stack.depth;
+  if (depth > CallStack::maxDepth) {
+    depth = CallStack::maxDepth;
+  }
+  std::atomic_signal_fence(std::memory_order_acquire);
+
+  auto at = profiler.used_.fetch_add(depth + 1);
+  if (at + depth + 1 > profiler.buffer_.size()) {
+    profiler.dropped_++;
+    return;
+  }
+
+  profiler.buffer_[at] = Int::box(depth);
+  std::copy(stack.frames, stack.frames + depth, &profiler.buffer_[at + 1]);
+}
+
+Expr* evalProfileForm(List* pList, Scope* pScope) {
+  std::string path;
+  if (pList->get(2) != nil) {
+    path = as<Str>(evalExpr(pList->get(2), pScope))->flat();
+  }
+
+  profiler.start();
+  try {
+    evalExpr(pList->get(1), pScope);
+  } catch (...) {
+    profiler.stop();
+    throw;
+  }
+  profiler.stop();
+
+  if (profiler.dropped()) {
+    std::cerr << "[profile] buffer full, dropped " << profiler.dropped() 
+              << " samples" << std::endl;
+  }
+  if (!path.empty()) {
+    profiler.writeCollapsed(path);
+  }
+  return profiler.table();
+}
+
+} // namespace corvid
+
+#endif
@@ -0,0 +1,188 @@
+//------------------------------------------------------------------------------
+/*
+*  
+*  The MIT License (MIT)
+* 
+*  Copyright (C) 2014 Cody Griffin (cody.m.griffin@gmail.com)
+* 
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+* 
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+* 
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*/
+
+
+#ifndef INCLUDED_RESOLVER_H
+#define INCLUDED_RESOLVER_H
+
+namespace corvid {
+
+//------------------------------------------------------------------------------
+/* 
+ *  The Resolver runs over each form after buildExpr and before evaluation.
+ *  Every lambda is replaced by a Lambda node that knows the size of its 
+ *  activation frame, and every symbol that names a lambda parameter (or a 
+ *  variable defined in a lambda body) is rewritten in place to a Local holding 
+ *  its (depth, slot) address.  Anything left as a Sym is a global.  Lists 
+ *  that are procedure calls rather than special forms become Call nodes.
+ *
+ *  Quoted data is left alone, and (defmemo (name params...) body) is expanded
+ *  to (define name (memoize (lambda (params...) body))) first.
+ */
+struct Resolver {
+  Resolver() 
+  : define_ (symbols.intern("define"))
+  , lambda_ (symbols.intern("lambda"))
+  , slash_  (symbols.intern(".\\"))
+  , quote_  (symbols.intern("quote"))
+  , set_    (symbols.intern("set!"))
+  , defmemo_(symbols.intern("defmemo"))
+  , memoize_(symbols.intern("memoize")) {
+  }
+
+  Expr* resolve(Expr* pExpr) {
+    if (Sym::is(pExpr)) {
+      return resolveSym(pExpr);
+    }
+
+    if (!List::is(pExpr) || !static_cast<List*>(pExpr)->pHead) {
+      return pExpr;
+    }
+
+    auto pList = static_cast<List*>(pExpr);
+    auto pHead = pList->pHead;
+    if (Sym::is(pHead)) {
+      auto keyword = Sym::unbox(pHead);
+      if (keyword == quote_) {
+        return pList;
+      }
+      if (keyword == lambda_ || keyword == slash_) {
+        return resolveLambda(as<List>(pList->get(1)), pList->get(2));
+      }
+      if (keyword == define_) {
+        return resolveDefine(pList);
+      }
+      if (keyword == defmemo_) {
+        return resolve(expandDefmemo(pList));
+      }
+      if (keyword == set_) {
+        resolveEach(pList->pTail->pTail);
+        pList->pTail->pHead = resolveSym(pList->get(1));
+        return pList;
+      }
+    }
+
+    resolveEach(pList);
+    if (getSpecialForm(pHead)) {
+      return pList;
+    }
+    return new Call(pList);
+  }
+
+private:
+  typedef std::vector<SymId> Frame;
+
+  Expr* resolveSym(Expr* pSym) {
+    auto symbol = as<Sym>(pSym);
+    auto depth  = 0u;
+    for (auto it = frames_.rbegin(); it != frames_.rend(); ++it, ++depth) {
+      for (size_t slot = 0; slot < it->size(); slot++) {
+        if ((*it)[slot] == symbol) {
+          return Local::box(depth, slot);
+        }
+      }
+    }
+    return pSym;
+  }
+
+  void resolveEach(List* pList) {
+    for (; pList && pList->pHead; pList = pList->pTail) {
+      pList->pHead = resolve(pList->pHead);
+    }
+  }
+
+  Lambda* resolveLambda(List* pParams, Expr* pBody) {
+    Frame frame;
+    for (; pParams && pParams->pHead; pParams = pParams->pTail) {
+      frame.push_back(as<Sym>(pParams->pHead));
+    }
+
+    frames_.push_back(frame);
+    pBody = resolve(pBody);
+    auto pLambda = new Lambda(frame, pBody, frames_.back().size());
+    frames_.pop_back();
+    return pLambda;
+  }
+
+  // (define (name params...) body) becomes (define name <lambda>), and inside
+  // a lambda body the name gets a slot in the enclosing frame
+  List* resolveDefine(List* pList) {
+    auto pTarget = pList->pTail;
+    auto pValue  = pTarget->pTail;
+
+    Expr* pName   = pTarget->pHead;
+    List* pParams = 0;
+    if (List::is(pName)) {
+      pParams = static_cast<List*>(pName)->pTail;
+      pName   = static_cast<List*>(pName)->pHead;
+    }
+
+    auto symbol = as<Sym>(pName);
+    if (!frames_.empty()) {
+      auto& frame = frames_.back();
+      if (std::find(frame.begin(), frame.end(), symbol) == frame.end()) {
+        frame.push_back(symbol);
+      }
+    }
+
+    pTarget->pHead = resolveSym(pName);
+    if (pParams) {
+      pValue->pHead = resolveLambda(pParams, pValue->pHead);
+    } else {
+      pValue->pHead = resolve(pValue->pHead);
+    }
+    return pList;
+  }
+
+  List* expandDefmemo(List* pList) {
+    auto pSignature = as<List>(pList->get(1));
+    auto pLambda    = new List(Sym::box(lambda_), 
+                      new List(pSignature->pTail, 
+                      new List(pList->get(2), nil)));
+    auto pMemoize   = new List(Sym::box(memoize_), new List(pLambda, nil));
+    return new List(Sym::box(define_), 
+           new List(pSignature->pHead, 
+           new List(pMemoize, nil)));
+  }
+
+  std::vector<Frame> frames_;
+
+  SymId define_;
+  SymId lambda_;
+  SymId slash_;
+  SymId quote_;
+  SymId set_;
+  SymId defmemo_;
+  SymId memoize_;
+};
+
+inline Expr* resolve(Expr* pExpr) {
+  return Resolver().resolve(pExpr);
+}
+
+} // namespace corvid
+
+#endif
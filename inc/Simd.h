@@ -0,0 +1,440 @@
+//------------------------------------------------------------------------------
+/*
+*  
+*  The MIT License (MIT)
+* 
+*  Copyright (C) 2014 Cody Griffin (cody.m.griffin@gmail.com)
+* 
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+* 
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+* 
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*/
+
+
+
+#ifndef INCLUDED_SIMD_H
+#define INCLUDED_SIMD_H
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+namespace corvid {
+
+//------------------------------------------------------------------------------
+/* 
+ *  Kernels for the packed numeric arrays.  Each one is a loop over GCC vector
+ *  types, written once and instantiated twice: with 16 byte vectors, which 
+ *  every x86-64 has as SSE2, and with 32 byte vectors compiled for AVX2.  
+ *  Which one runs is decided once from cpuid.  Whatever doesn't fill a whole
+ *  vector at the end is done one element at a time.
+ *
+ *  The kernels know nothing about corvid values; they take the element type
+ *  and raw pointers to the arrays' storage.
+ */
+enum ArrayElem {
+  F32,
+  F64,
+  I32,
+  I64,
+};
+
+enum BinaryOp {
+  ADD,
+  SUB,
+  MUL,
+  DIV,
+  MIN,
+  MAX,
+};
+
+enum CompareOp {
+  LT,
+  GT,
+  EQ,
+};
+
+enum ReduceOp {
+  SUM,
+  DOT,
+  LEAST,
+  GREATEST,
+};
+
+inline size_t elemSize(ArrayElem elem) {
+  return elem == F32 || elem == I32 ? 4 : 8;
+}
+
+// Comparisons yield 1 or 0 in an integer of the same width
+inline ArrayElem maskElem(ArrayElem elem) {
+  return elemSize(elem) == 4 ? I32 : I64;
+}
+
+template <size_t W, typename T>
+struct Lanes {
+  typedef T Type __attribute__((vector_size(W)));
+  static const size_t count = W / sizeof(T);
+};
+
+template <typename T>
+struct MaskOf {
+  typedef typename std::conditional<sizeof(T) == 4, int32_t, int64_t>::type Type;
+};
+
+#define CORVID_KERNEL inline __attribute__((always_inline))
+
+template <BinaryOp OP, typename T>
+CORVID_KERNEL T binaryScalar(T a, T b) {
+  switch (OP) {
+    case ADD: return a + b;
+    case SUB: return a - b;
+    case MUL: return a * b;
+    case DIV: return a / b;
+    case MIN: return a < b ? a : b;
+    case MAX: return a > b ? a : b;
+  }
+  return a;
+}
+
+template <size_t W, BinaryOp OP, typename T>
+CORVID_KERNEL void binaryLoop(T* pOut, const T* pA, const T* pB, size_t n) {
+  typedef typename Lanes<W, T>::Type V;
+  const size_t lanes = Lanes<W, T>::count;
+
+  size_t i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    V a, b, r;
+    memcpy(&a, pA + i, W);
+    memcpy(&b, pB + i, W);
+    switch (OP) {
+      case ADD: r = a + b;          break;
+      case SUB: r = a - b;          break;
+      case MUL: r = a * b;          break;
+      case DIV: r = a / b;          break;
+      case MIN: r = a < b ? a : b;  break;
+      case MAX: r = a > b ? a : b;  break;
+    }
+    memcpy(pOut + i, &r, W);
+  }
+
+  for (; i < n; i++) {
+    pOut[i] = binaryScalar<OP>(pA[i], pB[i]);
+  }
+}
+
+template <size_t W, CompareOp OP, typename T>
+CORVID_KERNEL void compareLoop(typename MaskOf<T>::Type* pOut, 
+                               const T* pA, const T* pB, size_t n) {
+  typedef typename Lanes<W, T>::Type V;
+  const size_t lanes = Lanes<W, T>::count;
+
+  size_t i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    V a, b;
+    memcpy(&a, pA + i, W);
+    memcpy(&b, pB + i, W);
+
+    // Vector comparisons give -1 for true
+    typename Lanes<W, typename MaskOf<T>::Type>::Type r;
+    switch (OP) {
+      case LT: r = -(a <  b); break;
+      case GT: r = -(a >  b); break;
+      case EQ: r = -(a == b); break;
+    }
+    memcpy(pOut + i, &r, W);
+  }
+
+  for (; i < n; i++) {
+    switch (OP) {
+      case LT: pOut[i] = pA[i] <  pB[i]; break;
+      case GT: pOut[i] = pA[i] >  pB[i]; break;
+      case EQ: pOut[i] = pA[i] == pB[i]; break;
+    }
+  }
+}
+
+template <size_t W, typename T>
+CORVID_KERNEL void axpyLoop(T* pOut, T alpha, const T* pX, const T* pY, 
+                            size_t n) {
+  typedef typename Lanes<W, T>::Type V;
+  const size_t lanes = Lanes<W, T>::count;
+
+  V a;
+  for (size_t k = 0; k < lanes; k++) {
+    a[k] = alpha;
+  }
+
+  size_t i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    V x, y;
+    memcpy(&x, pX + i, W);
+    memcpy(&y, pY + i, W);
+    y += a * x;
+    memcpy(pOut + i, &y, W);
+  }
+
+  for (; i < n; i++) {
+    pOut[i] = alpha * pX[i] + pY[i];
+  }
+}
+
+// Min and max need at least one element
+template <size_t W, ReduceOp OP, typename T>
+CORVID_KERNEL T reduceLoop(const T* pA, const T* pB, size_t n) {
+  typedef typename Lanes<W, T>::Type V;
+  const size_t lanes = Lanes<W, T>::count;
+
+  T result = OP == LEAST || OP == GREATEST ? pA[0] : 0;
+  size_t i = 0;
+  if (n >= lanes) {
+    V acc = { 0 };
+    if (OP == LEAST || OP == GREATEST) {
+      memcpy(&acc, pA, W);
+    }
+
+    for (; i + lanes <= n; i += lanes) {
+      V a, b;
+      memcpy(&a, pA + i, W);
+      switch (OP) {
+        case SUM:      acc += a;                      break;
+        case DOT:      memcpy(&b, pB + i, W);
+                       acc += a * b;                  break;
+        case LEAST:    acc = a < acc ? a : acc;       break;
+        case GREATEST: acc = a > acc ? a : acc;       break;
+      }
+    }
+
+    result = acc[0];
+    for (size_t k = 1; k < lanes; k++) {
+      switch (OP) {
+        case SUM:
+        case DOT:      result += acc[k];                                break;
+        case LEAST:    result = acc[k] < result ? acc[k] : result;     break;
+        case GREATEST: result = acc[k] > result ? acc[k] : result;     break;
+      }
+    }
+  }
+
+  for (; i < n; i++) {
+    switch (OP) {
+      case SUM:      result += pA[i];                                  break;
+      case DOT:      result += pA[i] * pB[i];                          break;
+      case LEAST:    result = pA[i] < result ? pA[i] : result;         break;
+      case GREATEST: result = pA[i] > result ? pA[i] : result;         break;
+    }
+  }
+  return result;
+}
+
+#undef CORVID_KERNEL
+
+//------------------------------------------------------------------------------
+
+// The two instantiations of every kernel
+template <size_t W>
+struct Kernels {
+  template <BinaryOp OP, typename T>
+  static void binary(T* pOut, const T* pA, const T* pB, size_t n) {
+    binaryLoop<W, OP>(pOut, pA, pB, n);
+  }
+
+  template <CompareOp OP, typename T>
+  static void compare(typename MaskOf<T>::Type* pOut, 
+                      const T* pA, const T* pB, size_t n) {
+    compareLoop<W, OP>(pOut, pA, pB, n);
+  }
+
+  template <typename T>
+  static void axpy(T* pOut, T alpha, const T* pX, const T* pY, size_t n) {
+    axpyLoop<W>(pOut, alpha, pX, pY, n);
+  }
+
+  template <ReduceOp OP, typename T>
+  static T reduce(const T* pA, const T* pB, size_t n) {
+    return reduceLoop<W, OP>(pA, pB, n);
+  }
+};
+
+#if defined(__x86_64__)
+template <>
+struct Kernels<32> {
+  template <BinaryOp OP, typename T> __attribute__((target("avx2")))
+  static void binary(T* pOut, const T* pA, const T* pB, size_t n) {
+    binaryLoop<32, OP>(pOut, pA, pB, n);
+  }
+
+  template <CompareOp OP, typename T> __attribute__((target("avx2")))
+  static void compare(typename MaskOf<T>::Type* pOut, 
+                      const T* pA, const T* pB, size_t n) {
+    compareLoop<32, OP>(pOut, pA, pB, n);
+  }
+
+  template <typename T> __attribute__((target("avx2")))
+  static void axpy(T* pOut, T alpha, const T* pX, const T* pY, size_t n) {
+    axpyLoop<32>(pOut, alpha, pX, pY, n);
+  }
+
+  template <ReduceOp OP, typename T> __attribute__((target("avx2")))
+  static T reduce(const T* pA, const T* pB, size_t n) {
+    return reduceLoop<32, OP>(pA, pB, n);
+  }
+};
+
+inline bool hasAvx2() {
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+}
+#else
+inline bool hasAvx2() {
+  return false;
+}
+#endif
+
+//------------------------------------------------------------------------------
+
+template <BinaryOp OP, typename T>
+void binary(void* pOut, const void* pA, const void* pB, size_t n) {
+  auto f = hasAvx2() ? &Kernels<32>::binary<OP, T> 
+                     : &Kernels<16>::binary<OP, T>;
+  f(static_cast<T*>(pOut), static_cast<const T*>(pA), 
+    static_cast<const T*>(pB), n);
+}
+
+template <typename T>
+void binary(BinaryOp op, void* pOut, const void* pA, const void* pB, size_t n) {
+  switch (op) {
+    case ADD: return binary<ADD, T>(pOut, pA, pB, n);
+    case SUB: return binary<SUB, T>(pOut, pA, pB, n);
+    case MUL: return binary<MUL, T>(pOut, pA, pB, n);
+    case DIV: return binary<DIV, T>(pOut, pA, pB, n);
+    case MIN: return binary<MIN, T>(pOut, pA, pB, n);
+    case MAX: return binary<MAX, T>(pOut, pA, pB, n);
+  }
+}
+
+template <typename T>
+bool hasZero(const void* p, size_t n) {
+  auto pItems = static_cast<const T*>(p);
+  for (size_t i = 0; i < n; i++) {
+    if (pItems[i] == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// pOut = pA op pB, elementwise over n elements of type elem
+inline void simdBinary(BinaryOp op, ArrayElem elem, void* pOut, 
+                       const void* pA, const void* pB, size_t n) {
+  if (op == DIV && ((elem == I32 && hasZero<int32_t>(pB, n)) ||
+                    (elem == I64 && hasZero<int64_t>(pB, n)))) {
+    throw std::runtime_error("Division by zero!");
+  }
+
+  switch (elem) {
+    case F32: return binary<float>  (op, pOut, pA, pB, n);
+    case F64: return binary<double> (op, pOut, pA, pB, n);
+    case I32: return binary<int32_t>(op, pOut, pA, pB, n);
+    case I64: return binary<int64_t>(op, pOut, pA, pB, n);
+  }
+}
+
+template <CompareOp OP, typename T>
+void compare(void* pOut, const void* pA, const void* pB, size_t n) {
+  auto f = hasAvx2() ? &Kernels<32>::compare<OP, T> 
+                     : &Kernels<16>::compare<OP, T>;
+  f(static_cast<typename MaskOf<T>::Type*>(pOut), 
+    static_cast<const T*>(pA), static_cast<const T*>(pB), n);
+}
+
+template <typename T>
+void compare(CompareOp op, void* pOut, const void* pA, const void* pB, 
+             size_t n) {
+  switch (op) {
+    case LT: return compare<LT, T>(pOut, pA, pB, n);
+    case GT: return compare<GT, T>(pOut, pA, pB, n);
+    case EQ: return compare<EQ, T>(pOut, pA, pB, n);
+  }
+}
+
+// pOut is a mask of maskElem(elem)
+inline void simdCompare(CompareOp op, ArrayElem elem, void* pOut, 
+                        const void* pA, const void* pB, size_t n) {
+  switch (elem) {
+    case F32: return compare<float>  (op, pOut, pA, pB, n);
+    case F64: return compare<double> (op, pOut, pA, pB, n);
+    case I32: return compare<int32_t>(op, pOut, pA, pB, n);
+    case I64: return compare<int64_t>(op, pOut, pA, pB, n);
+  }
+}
+
+template <typename T>
+void axpy(void* pOut, double alpha, const void* pX, const void* pY, size_t n) {
+  auto f = hasAvx2() ? &Kernels<32>::axpy<T> : &Kernels<16>::axpy<T>;
+  f(static_cast<T*>(pOut), static_cast<T>(alpha), 
+    static_cast<const T*>(pX), static_cast<const T*>(pY), n);
+}
+
+// pOut = alpha * pX + pY
+inline void simdAxpy(ArrayElem elem, void* pOut, double alpha, 
+                     const void* pX, const void* pY, size_t n) {
+  switch (elem) {
+    case F32: return axpy<float>  (pOut, alpha, pX, pY, n);
+    case F64: return axpy<double> (pOut, alpha, pX, pY, n);
+    case I32: return axpy<int32_t>(pOut, alpha, pX, pY, n);
+    case I64: return axpy<int64_t>(pOut, alpha, pX, pY, n);
+  }
+}
+
+template <ReduceOp OP, typename T>
+double reduce(const void* pA, const void* pB, size_t n) {
+  auto f = hasAvx2() ? &Kernels<32>::reduce<OP, T> 
+                     : &Kernels<16>::reduce<OP, T>;
+  return f(static_cast<const T*>(pA), static_cast<const T*>(pB), n);
+}
+
+template <typename T>
+double reduce(ReduceOp op, const void* pA, const void* pB, size_t n) {
+  switch (op) {
+    case SUM:      return reduce<SUM,      T>(pA, pB, n);
+    case DOT:      return reduce<DOT,      T>(pA, pB, n);
+    case LEAST:    return reduce<LEAST,    T>(pA, pB, n);
+    case GREATEST: return reduce<GREATEST, T>(pA, pB, n);
+  }
+  return 0;
+}
+
+// pB is only read by DOT.  LEAST and GREATEST need n > 0.
+inline double simdReduce(ReduceOp op, ArrayElem elem, 
+                         const void* pA, const void* pB, size_t n) {
+  if ((op == LEAST || op == GREATEST) && n == 0) {
+    throw std::runtime_error("Empty array!");
+  }
+
+  switch (elem) {
+    case F32: return reduce<float>  (op, pA, pB, n);
+    case F64: return reduce<double> (op, pA, pB, n);
+    case I32: return reduce<int32_t>(op, pA, pB, n);
+    case I64: return reduce<int64_t>(op, pA, pB, n);
+  }
+  return 0;
+}
+
+} // namespace corvid
+
+#endif
@@ -0,0 +1,657 @@
+//------------------------------------------------------------------------------
+/*
+*  
+*  The MIT License (MIT)
+* 
+*  Copyright (C) 2014 Cody Griffin (cody.m.griffin@gmail.com)
+* 
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+* 
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+* 
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*/
+
+
+
+#ifndef INCLUDED_VM_H
+#define INCLUDED_VM_H
+
+namespace corvid {
+
+//------------------------------------------------------------------------------
+/* 
+ *  An alternative to walking the tree with List::eval.  Each top level form is
+ *  compiled, after the Resolver has run, into a Proto holding bytecode for a 
+ *  stack machine, and every Lambda inside it into a nested Proto.  
+ *
+ *  The dispatch loop is direct threaded: the first time a Proto runs, each
+ *  instruction's opcode is swapped for the address of its handler.  Calls 
+ *  between compiled closures push a Vm frame instead of recursing in C++, and
+ *  strict natives are handed their arguments straight off the stack.  Forms 
+ *  (natives which take their arguments unevaluated) and special forms the 
+ *  compiler does not know about fall back to the tree walker.
+ */
+struct Instr {
+  enum Op {
+    CONST,        // push constants[a]
+    GLOBAL,       // push the value bound to symbol a, cached in caches[b]
+    LOCAL0,       // push slot a of the current frame
+    LOCAL,        // push slot b of the frame a levels up
+    SET_LOCAL,    // store the top of the stack in slot b, a levels up
+    DEFINE,       // bind symbol a to the top of the stack here
+    ASSIGN,       // rebind symbol a to the top of the stack
+    JUMP,         // continue at a
+    JUMP_IF_LIST, // pop, continue at a if it was a list (false)
+    CLOSURE,      // push a closure over protos[a]
+    PREPARE,      // check the callee, forms are called with constants[a]
+                  // and continue at b
+    CALL,         // call the function below the top a values
+    TAIL_CALL,    // likewise, replacing the current frame
+    POP,
+    EVAL,         // push the value of constants[a] from the tree walker
+    RETURN,
+    FOLDED,       // push the value of constants[a], a Folded call, making
+                  // the call if it no longer holds
+    OP_COUNT
+  };
+
+  Instr(Op o, int32_t x = 0, int32_t y = 0) 
+  : pLabel(0)
+  , op(o)
+  , a(x)
+  , b(y) {
+  }
+
+  void*   pLabel;
+  int32_t op;
+  int32_t a;
+  int32_t b;
+};
+
+struct Proto : public Cell {
+  Proto(size_t n = 0, size_t k = 0) 
+  : frameSize(n)
+  , arity(k)
+  , maxStack(0)
+  , threaded(false) {
+  }
+
+  void trace(Gc& gc) {
+    for (auto pConstant : constants) {
+      markExpr(gc, pConstant);
+    }
+    for (auto pProto : protos) {
+      gc.mark(pProto);
+    }
+  }
+
+  // Where a global was last found
+  struct Cache {
+    Cache() : ppValue(0), epoch(0) {}
+
+    Expr** ppValue;
+    size_t epoch;
+  };
+
+  std::vector<Instr>  code;
+  std::vector<Expr*>  constants;
+  std::vector<Proto*> protos;
+  std::vector<Cache>  caches;
+  size_t              frameSize;
+  size_t              arity;
+  size_t              maxStack;
+  std::atomic<bool>   threaded;
+};
+
+//------------------------------------------------------------------------------
+
+struct Compiler {
+  Compiler() 
+  : define_ (symbols.intern("define"))
+  , quote_  (symbols.intern("quote"))
+  , if_     (symbols.intern("if"))
+  , set_    (symbols.intern("set!"))
+  , begin_  (symbols.intern("begin"))
+  , depth_  (0) {
+  }
+
+  Proto* compile(Expr* pExpr, size_t frameSize = 0, size_t arity = 0) {
+    auto pProto = new Proto(frameSize, arity);
+    auto depth  = depth_;
+
+    depth_ = 0;
+    compileExpr(pProto, pExpr, true);
+    emit(pProto, Instr::RETURN);
+    depth_ = depth;
+
+    return pProto;
+  }
+
+private:
+  // Calls in tail position replace the caller's frame
+  void compileExpr(Proto* pProto, Expr* pExpr, bool tail = false) {
+    switch (tagOf(pExpr)) {
+      case SYM_TAG:   
+        pProto->caches.push_back(Proto::Cache());
+        emit(pProto, Instr::GLOBAL, Sym::unbox(pExpr), 
+             pProto->caches.size() - 1); 
+        push(pProto);
+        return;
+
+      case LOCAL_TAG: 
+        if (Local::depth(pExpr) == 0) {
+          emit(pProto, Instr::LOCAL0, Local::slot(pExpr));
+        } else {
+          emit(pProto, Instr::LOCAL, Local::depth(pExpr), Local::slot(pExpr));
+        }
+        push(pProto);
+        return;
+
+      case HEAP_TAG:
+        if (Lambda::is(pExpr)) {
+          compileLambda(pProto, static_cast<Lambda*>(pExpr));
+          return;
+        }
+        if (Call::is(pExpr)) {
+          compileList(pProto, static_cast<Call*>(pExpr)->pForm, tail);
+          return;
+        }
+        if (List::is(pExpr) && static_cast<List*>(pExpr)->pHead) {
+          compileList(pProto, static_cast<List*>(pExpr), tail);
+          return;
+        }
+        if (Folded::is(pExpr)) {
+          emitConstant(pProto, Instr::FOLDED, pExpr);
+          return;
+        }
+        break;
+
+      default:
+        break;
+    }
+
+    // Numbers, strings, functions and the empty list evaluate to themselves
+    emitConstant(pProto, Instr::CONST, pExpr);
+  }
+
+  void compileList(Proto* pProto, List* pList, bool tail) {
+    auto pHead = pList->pHead;
+    if (getSpecialForm(pHead)) {
+      auto keyword = Sym::unbox(pHead);
+      if (keyword == quote_) {
+        emitConstant(pProto, Instr::CONST, pList->get(1));
+      } else if (keyword == if_) {
+        compileIf(pProto, pList, tail);
+      } else if (keyword == begin_) {
+        compileBegin(pProto, pList, tail);
+      } else if ((keyword == define_ || keyword == set_) && 
+                 !List::is(pList->get(1))) {
+        compileDefine(pProto, pList, keyword == define_);
+      } else {
+        emitConstant(pProto, Instr::EVAL, pList);
+      }
+      return;
+    }
+
+    compileExpr(pProto, pHead);
+    auto prepare = emitConstant(pProto, Instr::PREPARE, pList->pTail);
+
+    int32_t count = 0;
+    for (auto pArgs = pList->pTail; pArgs && pArgs->pHead; pArgs = pArgs->pTail) {
+      compileExpr(pProto, pArgs->pHead);
+      count++;
+    }
+
+    emit(pProto, tail ? Instr::TAIL_CALL : Instr::CALL, count);
+    pop(pProto, count);
+    pProto->code[prepare].b = pProto->code.size();
+  }
+
+  void compileIf(Proto* pProto, List* pList, bool tail) {
+    compileExpr(pProto, pList->get(1));
+    auto jumpToElse = emit(pProto, Instr::JUMP_IF_LIST);
+    pop(pProto);
+
+    compileExpr(pProto, pList->get(2), tail);
+    auto jumpToEnd = emit(pProto, Instr::JUMP);
+    pop(pProto);
+
+    pProto->code[jumpToElse].a = pProto->code.size();
+    compileExpr(pProto, pList->get(3), tail);
+    pProto->code[jumpToEnd].a = pProto->code.size();
+  }
+
+  void compileBegin(Proto* pProto, List* pList, bool tail) {
+    auto pForms = pList->pTail;
+    if (!pForms || !pForms->pHead) {
+      emitConstant(pProto, Instr::CONST, nil);
+      return;
+    }
+
+    for (; pForms->pTail && pForms->pTail->pHead; pForms = pForms->pTail) {
+      compileExpr(pProto, pForms->pHead);
+      emit(pProto, Instr::POP);
+      pop(pProto);
+    }
+    compileExpr(pProto, pForms->pHead, tail);
+  }
+
+  void compileDefine(Proto* pProto, List* pList, bool define) {
+    auto pName = pList->get(1);
+    compileExpr(pProto, pList->get(2));
+
+    if (Local::is(pName)) {
+      emit(pProto, Instr::SET_LOCAL, Local::depth(pName), Local::slot(pName));
+    } else {
+      emit(pProto, define ? Instr::DEFINE : Instr::ASSIGN, as<Sym>(pName));
+    }
+  }
+
+  void compileLambda(Proto* pProto, Lambda* pLambda) {
+    auto pChild = compile(pLambda->pBody, pLambda->frameSize, 
+                          pLambda->params.size());
+    pProto->protos.push_back(pChild);
+    emit(pProto, Instr::CLOSURE, pProto->protos.size() - 1);
+    push(pProto);
+  }
+
+  size_t emit(Proto* pProto, Instr::Op op, int32_t a = 0, int32_t b = 0) {
+    pProto->code.push_back(Instr(op, a, b));
+    return pProto->code.size() - 1;
+  }
+
+  size_t emitConstant(Proto* pProto, Instr::Op op, Expr* pExpr) {
+    pProto->constants.push_back(pExpr);
+    auto at = emit(pProto, op, pProto->constants.size() - 1);
+    if (op != Instr::PREPARE) {
+      push(pProto);
+    }
+    return at;
+  }
+
+  void push(Proto* pProto) {
+    depth_++;
+    pProto->maxStack = std::max(pProto->maxStack, depth_);
+  }
+
+  void pop(Proto* pProto, size_t count = 1) {
+    depth_ -= count;
+  }
+
+  SymId  define_;
+  SymId  quote_;
+  SymId  if_;
+  SymId  set_;
+  SymId  begin_;
+  size_t depth_;
+};
+
+//------------------------------------------------------------------------------
+
+struct Vm {
+  static const size_t stackSize = 1 << 18;
+  static const size_t maxFrames = 1 << 20;
+
+  // A Vm that is not rooted must be traced by whatever owns it
+  explicit Vm(bool rooted = true) 
+  : stack_(new Expr*[stackSize])
+  , sp_(stack_)
+  , rooted_(rooted) {
+    if (rooted) {
+      roots_ = gc.addRoots([this](Gc& gc) { 
+        trace(gc); 
+      });
+    }
+  }
+
+  ~Vm() {
+    if (rooted_) {
+      gc.removeRoots(roots_);
+    }
+    delete [] stack_;
+  }
+
+  void trace(Gc& gc) {
+    for (auto pp = stack_; pp < sp_; pp++) {
+      markExpr(gc, *pp);
+    }
+    for (auto& frame : frames_) {
+      gc.mark(frame.pProto);
+      gc.mark(frame.pEnv);
+    }
+  }
+
+  // Compile and run a top level form
+  Expr* eval(Expr* pExpr, Scope* pScope) {
+    auto pProto = Compiler().compile(pExpr);
+    auto entry  = frames_.size();
+    pushFrame(pProto, pScope, sp_, false);
+    return execute(entry);
+  }
+
+  // Call a compiled closure from native code
+  Expr* apply(Fun* pFun, Expr** ppArgs, size_t count) {
+    auto pProto = pFun->pProto;
+    checkArity(pProto, count);
+    checkStack(pProto, sp_ + count + 1);
+
+    auto entry = frames_.size();
+    auto sp    = sp_;
+    *sp++ = pFun;
+    sp = std::copy(ppArgs, ppArgs + count, sp);
+    sp_ = enter(pFun, count, sp);
+    return execute(entry);
+  }
+
+  Fun* closure(Proto* pProto, Scope* pEnv);
+
+private:
+
+  // Frames own their scope unless it was handed to eval
+  struct Frame {
+    Proto*       pProto;
+    const Instr* pc;
+    Scope*       pEnv;
+    size_t       base;
+    size_t       calls;    // depth of the profiler's call stack
+    bool         owned;
+  };
+
+  void checkArity(Proto* pProto, size_t count) {
+    if (count > pProto->arity) {
+      throw std::runtime_error("Too many arguments to lambda!");
+    }
+  }
+
+  void checkStack(Proto* pProto, Expr** sp) {
+    if (sp + pProto->maxStack > stack_ + stackSize || 
+        frames_.size() >= maxFrames) {
+      throw std::runtime_error("Stack overflow!");
+    }
+  }
+
+  void pushFrame(Proto* pProto, Scope* pEnv, Expr** sp, bool owned) {
+    checkStack(pProto, sp);
+    Frame frame = { 
+      pProto, pProto->code.data(), pEnv, size_t(sp - stack_), calls().depth, 
+      owned 
+    };
+    frames_.push_back(frame);
+  }
+
+  // A scope holding the arguments on top of the stack, recycling pEnv if it
+  // is free
+  Scope* bind(Fun* pFun, Expr** sp, size_t count, Scope* pEnv = 0) {
+    auto frameSize = pFun->pProto->frameSize;
+    if (!pEnv || !pEnv->recyclable(pFun->pEnv, frameSize)) {
+      pEnv = pFun->pEnv->extend(frameSize);
+    }
+
+    auto end = std::copy(sp - count, sp, pEnv->slots_.begin());
+    std::fill(end, pEnv->slots_.end(), nil);
+    return pEnv;
+  }
+
+  // Pops the callee and its arguments into a new activation frame
+  Expr** enter(Fun* pFun, size_t count, Expr** sp) {
+    auto pEnv = bind(pFun, sp, count);
+    sp -= count + 1;
+    pushFrame(pFun->pProto, pEnv, sp, true);
+    if (profiling.load(std::memory_order_relaxed)) {
+      pushCall(calls(), frames_.back().calls, pFun);
+    }
+    return sp;
+  }
+
+  Expr* execute(size_t entry) {
+    static void* labels[Instr::OP_COUNT] = {
+      &&CONST, &&GLOBAL, &&LOCAL0, &&LOCAL, &&SET_LOCAL, &&DEFINE, &&ASSIGN,
+      &&JUMP, &&JUMP_IF_LIST, &&CLOSURE, &&PREPARE, &&CALL, &&TAIL_CALL, 
+      &&POP, &&EVAL, &&RETURN, &&FOLDED
+    };
+
+    Proto*       pProto;
+    const Instr* pCode;
+    const Instr* pc;
+    const Instr* pInstr;
+    Scope*       pEnv;
+    Expr**       sp = sp_;
+
+#define CORVID_LOAD_FRAME()                                \
+    {                                                      \
+      auto& frame = frames_.back();                        \
+      pProto = frame.pProto;                               \
+      pCode  = pProto->code.data();                        \
+      pc     = frame.pc;                                   \
+      pEnv   = frame.pEnv;                                 \
+      if (!pProto->threaded) {                             \
+        for (auto& instr : pProto->code) {                 \
+          instr.pLabel = labels[instr.op];                 \
+        }                                                  \
+        pProto->threaded = true;                           \
+      }                                                    \
+    }
+
+#define CORVID_NEXT()                                      \
+    pInstr = pc++;                                         \
+    goto *pInstr->pLabel;
+
+    try {
+      CORVID_LOAD_FRAME();
+      CORVID_NEXT();
+
+    CONST:
+      *sp++ = pProto->constants[pInstr->a];
+      CORVID_NEXT();
+
+    GLOBAL: {
+      auto& cache = pProto->caches[pInstr->b];
+      if (!cache.ppValue || cache.epoch != Scope::shadowEpoch) {
+        cache.ppValue = pEnv->findGlobal(pInstr->a);
+        cache.epoch   = Scope::shadowEpoch;
+      }
+      *sp++ = cache.ppValue ? *cache.ppValue : pEnv->getValue(pInstr->a);
+      CORVID_NEXT();
+    }
+
+    LOCAL0:
+      *sp++ = pEnv->slots_[pInstr->a];
+      CORVID_NEXT();
+
+    LOCAL:
+      *sp++ = scopeAt(pEnv, pInstr->a)->slots_[pInstr->b];
+      CORVID_NEXT();
+
+    SET_LOCAL:
+      scopeAt(pEnv, pInstr->a)->slots_[pInstr->b] = sp[-1];
+      CORVID_NEXT();
+
+    DEFINE:
+      nameFun(sp[-1], SymId(pInstr->a));
+      pEnv->setValue(SymId(pInstr->a), sp[-1]);
+      CORVID_NEXT();
+
+    ASSIGN:
+      pEnv->assign(SymId(pInstr->a), sp[-1]);
+      CORVID_NEXT();
+
+    JUMP:
+      pc = pCode + pInstr->a;
+      CORVID_NEXT();
+
+    JUMP_IF_LIST:
+      if (List::is(*--sp)) {
+        pc = pCode + pInstr->a;
+      }
+      CORVID_NEXT();
+
+    CLOSURE:
+      *sp++ = closure(pProto->protos[pInstr->a], pEnv);
+      CORVID_NEXT();
+
+    PREPARE: {
+      // Everything live is on the stack or in a frame
+      sp_ = sp;
+      gc.poll();
+
+      auto pFun = as<Fun>(sp[-1]);
+      if (!pFun->pProto && !pFun->call) {
+        auto pArgs = static_cast<List*>(pProto->constants[pInstr->a]);
+        metrics().nativeCalls.bump();
+        sp[-1] = pFun->fun(pArgs, pEnv);
+        pc = pCode + pInstr->b;
+      }
+      CORVID_NEXT();
+    }
+
+    CALL: {
+      size_t count = pInstr->a;
+      auto   pFun  = static_cast<Fun*>(sp[-count - 1]);
+      if (pFun->pProto) {
+        checkArity(pFun->pProto, count);
+        frames_.back().pc = pc;
+        sp = enter(pFun, count, sp);
+        CORVID_LOAD_FRAME();
+      } else {
+        sp_ = sp;
+        metrics().nativeCalls.bump();
+        auto pResult = pFun->call(sp - count, count);
+        sp -= count;
+        sp[-1] = pResult;
+      }
+      CORVID_NEXT();
+    }
+
+    TAIL_CALL: {
+      size_t count = pInstr->a;
+      auto   pFun  = static_cast<Fun*>(sp[-count - 1]);
+      if (!pFun->pProto) {
+        goto CALL;
+      }
+
+      auto& frame = frames_.back();
+      checkArity(pFun->pProto, count);
+      checkStack(pFun->pProto, stack_ + frame.base);
+      auto pOld    = frame.owned ? frame.pEnv : 0;
+      frame.pEnv   = bind(pFun, sp, count, pOld);
+      if (pOld && pOld != frame.pEnv) {
+        pOld->release();
+      }
+      frame.pProto = pFun->pProto;
+      frame.pc     = frame.pProto->code.data();
+      frame.owned  = true;
+      if (profiling.load(std::memory_order_relaxed)) {
+        pushCall(calls(), frame.calls, pFun);
+      }
+      sp = stack_ + frame.base;
+      CORVID_LOAD_FRAME();
+      CORVID_NEXT();
+    }
+
+    POP:
+      sp--;
+      CORVID_NEXT();
+
+    EVAL:
+      sp_ = sp;
+      *sp = evalExpr(pProto->constants[pInstr->a], pEnv);
+      sp++;
+      CORVID_NEXT();
+
+    FOLDED: {
+      auto pFolded = static_cast<Folded*>(pProto->constants[pInstr->a]);
+      if (pFolded->current()) {
+        *sp++ = pFolded->pValue;
+      } else {
+        sp_ = sp;
+        *sp = evalExpr(pFolded->pForm, pEnv);
+        sp++;
+      }
+      CORVID_NEXT();
+    }
+
+    RETURN: {
+      auto pResult = sp[-1];
+      sp = stack_ + frames_.back().base;
+      calls().depth = frames_.back().calls;
+      if (frames_.back().owned) {
+        frames_.back().pEnv->release();
+      }
+      frames_.pop_back();
+      if (frames_.size() == entry) {
+        sp_ = sp;
+        return pResult;
+      }
+      *sp++ = pResult;
+      CORVID_LOAD_FRAME();
+      CORVID_NEXT();
+    }
+    }
+    catch (...) {
+      sp_ = stack_ + frames_[entry].base;
+      calls().depth = frames_[entry].calls;
+      frames_.resize(entry);
+      throw;
+    }
+
+#undef CORVID_NEXT
+#undef CORVID_LOAD_FRAME
+  }
+
+  static Scope* scopeAt(Scope* pScope, size_t depth) {
+    for (; depth; depth--) {
+      pScope = pScope->pParentScope_;
+    }
+    return pScope;
+  }
+
+  Expr**             stack_;
+  Expr**             sp_;
+  std::vector<Frame> frames_;
+  bool               rooted_;
+  Gc::RootsId        roots_;
+};
+
+// One per thread, so that workers can run compiled code alongside each other.
+// Green threads bring their own and point pVm at it while they run.
+thread_local Vm  threadVm;
+thread_local Vm* pVm = &threadVm;
+
+// Top level forms are run by the tree walker unless --vm is given
+bool useVm = false;
+
+// Compiled closures can still be called from the tree walker and from natives
+inline Fun* Vm::closure(Proto* pProto, Scope* pEnv) {
+  auto pFun = new Fun(Fun::Form());
+  pFun->pProto = pProto;
+  pFun->pEnv   = pEnv;
+  pEnv->escape();
+
+  pFun->fun = [pFun](List* pArgs, Scope* pScope) {
+    RootScope roots;
+    Arguments args(pArgs, pScope);
+    return pVm->apply(pFun, args.data(), args.size());
+  };
+  pFun->call = [pFun](Expr** ppArgs, size_t count) {
+    return pVm->apply(pFun, ppArgs, count);
+  };
+
+  return pFun->capture(pProto)->capture(pEnv);
+}
+
+} // namespace corvid
+
+#endif
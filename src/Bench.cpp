@@ -0,0 +1,355 @@
+//------------------------------------------------------------------------------
+/*
+*  
+*  The MIT License (MIT)
+* 
+*  Copyright (C) 2014 Cody Griffin (cody.m.griffin@gmail.com)
+* 
+*  Permission is hereby granted, free of charge, to any person obtaining a copy
+*  of this software and associated documentation files (the "Software"), to deal
+*  in the Software without restriction, including without limitation the rights
+*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*  copies of the Software, and to permit persons to whom the Software is
+*  furnished to do so, subject to the following conditions:
+* 
+*  The above copyright notice and this permission notice shall be included in all
+*  copies or substantial portions of the Software.
+* 
+*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*  SOFTWARE.
+*/
+
+//------------------------------------------------------------------------------
+/* 
+ *  Benchmarks for the interpreter.
+ *
+ *  Each benchmark runs in a child process of its own, so that they cannot 
+ *  disturb one another and each gets an honest peak RSS.  The child starts 
+ *  the interpreter, loads the prelude, evaluates the benchmark's setup and 
+ *  then times its operation: enough repetitions to fill a sample, and the 
+ *  median of several samples.  Startup itself is benchmarked by timing the 
+ *  first part alone, in several children.
+ *
+ *  Results go to bench_output.txt as JSON: nanoseconds and allocations per 
+ *  operation, and peak RSS in kilobytes.
+ *
+ *    bench [--vm] [--out <file>] [name...]
+ */
+#define CORVID_NO_MAIN
+#include "Corvid.cpp"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+namespace {
+
+struct Benchmark {
+  std::string name;
+  std::string setup;    // Evaluated once, untimed
+  std::string op;       // One operation, or empty to time startup
+};
+
+struct Result {
+  double nsPerOp;
+  double allocsPerOp;
+  long   peakRssKb;
+  size_t ops;
+};
+
+const double sampleSeconds  = 0.2;
+const size_t samples        = 5;
+const size_t startupRuns    = 10;
+
+// Deep recursion runs on a stack this big
+const size_t stackSize      = size_t(1) << 30;
+
+// Everything allocated on the heap so far: objects and scopes
+uint64_t allocations() {
+  auto totals = metricsRegistry.totals();
+  uint64_t count = totals.scopes;
+  for (size_t type = 0; type < Expr::TYPES; type++) {
+    count += totals.allocs[type];
+  }
+  return count;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> elapsed = 
+    std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+Expr* parse(const std::string& source) {
+  auto pSource = std::make_shared<std::string>(source);
+  auto b = pSource->begin();
+  auto e = pSource->end();
+
+  ParseArena      arena;
+  ParseArena::Use useArena(arena);
+  return prepare(buildExpr(program.parse(b, e), pSource));
+}
+
+// Runs one benchmark in this (child) process
+Result measure(const Benchmark& benchmark) {
+  Result result = {};
+  auto start  = std::chrono::steady_clock::now();
+  auto before = allocations();
+
+  initGlobalScope();
+  evalSource("(load \"prelude.cvd\")");
+
+  if (benchmark.op.empty()) {
+    result.nsPerOp     = secondsSince(start) * 1e9;
+    result.allocsPerOp = allocations() - before;
+    result.ops         = 1;
+    return result;
+  }
+
+  evalSource(benchmark.setup);
+
+  RootScope roots;
+  auto pOp = rootExpr(parse(benchmark.op));
+  evalTopLevel(pOp);
+
+  // Find how many operations fill a sample
+  size_t ops = 1;
+  for (;;) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ops; i++) {
+      evalTopLevel(pOp);
+      gc.poll();
+    }
+    if (secondsSince(start) >= sampleSeconds / 4) {
+      ops = std::max<size_t>(1, ops * sampleSeconds / secondsSince(start));
+      break;
+    }
+    ops *= 2;
+  }
+
+  std::vector<double> times;
+  before = allocations();
+  for (size_t sample = 0; sample < samples; sample++) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ops; i++) {
+      evalTopLevel(pOp);
+      gc.poll();
+    }
+    times.push_back(secondsSince(start) * 1e9 / ops);
+  }
+  std::sort(times.begin(), times.end());
+
+  result.nsPerOp     = times[times.size() / 2];
+  result.allocsPerOp = double(allocations() - before) / (ops * samples);
+  result.ops         = ops * samples;
+  return result;
+}
+
+struct Job {
+  const Benchmark* pBenchmark;
+  Result           result;
+  std::string      error;
+};
+
+void* runJob(void* pArg) {
+  auto pJob = static_cast<Job*>(pArg);
+  try {
+    pJob->result = measure(*pJob->pBenchmark);
+  } catch (std::exception& e) {
+    pJob->error = e.what();
+  }
+  return 0;
+}
+
+// Forks a child to measure the benchmark, which reports back through a pipe
+bool runChild(const Benchmark& benchmark, Result& result, std::string& error) {
+  int fds[2];
+  if (pipe(fds) < 0) {
+    throw std::runtime_error("Couldn't create a pipe!");
+  }
+
+  std::cout.flush();
+  auto pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+
+    // The prelude prints as it loads
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+
+    Job job = { &benchmark, Result(), "" };
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stackSize);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, &runJob, &job) != 0) {
+      _exit(1);
+    }
+    pthread_join(thread, 0);
+
+    if (!job.error.empty()) {
+      write(fds[1], job.error.data(), job.error.size());
+      _exit(2);
+    }
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    job.result.peakRssKb = usage.ru_maxrss;
+    write(fds[1], &job.result, sizeof(job.result));
+    _exit(0);
+  }
+
+  close(fds[1]);
+  std::string reply;
+  char buffer[256];
+  for (ssize_t got; (got = read(fds[0], buffer, sizeof(buffer))) > 0; ) {
+    reply.append(buffer, got);
+  }
+  close(fds[0]);
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  if (WIFSIGNALED(status)) {
+    error = "killed by signal " + std::to_string(WTERMSIG(status));
+  } else if (WEXITSTATUS(status) != 0 || reply.size() != sizeof(result)) {
+    error = reply.empty() ? "failed" : reply;
+  } else {
+    memcpy(&result, reply.data(), sizeof(result));
+    return true;
+  }
+  return false;
+}
+
+std::string quote(const std::string& text) {
+  std::string quoted = "\"";
+  for (auto c : text) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+    }
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+std::vector<Benchmark> benchmarks() {
+  std::string range = 
+    "(define (range n acc) (if (= n 0) acc (range (- n 1) (cons n acc))))"
+    "(define xs (range 100000 ()))";
+
+  std::string table = "(define table (list";
+  for (int i = 0; i < 1000; i++) {
+    table += " \"k" + std::to_string(i) + "\" " + std::to_string(i);
+  }
+  table += "))";
+
+  return {
+    { "fib",
+      "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))",
+      "(fib 20)" },
+    { "foldl-1e5",
+      range,
+      "(foldl + 0 xs)" },
+    { "map-1e5",
+      range,
+      "(map (lambda (x) (* x 2)) xs)" },
+    { "lookup-1e3",
+      table,
+      "(lookup \"k999\" table)" },
+    { "closure-storm",
+      "(define (adder n) (lambda (x) (+ x n)))"
+      "(define (storm n acc) (if (= n 0) acc (storm (- n 1) ((adder n) acc))))",
+      "(storm 10000 0)" },
+    { "deep-recursion",
+      "(define (depth n) (if (= n 0) 0 (+ 1 (depth (- n 1)))))",
+      "(depth 100000)" },
+    { "startup",
+      "",
+      "" },
+  };
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  std::string              path = "bench_output.txt";
+  std::vector<std::string> only;
+  for (int arg = 1; arg < argc; arg++) {
+    std::string option = argv[arg];
+    if (option == "--vm") {
+      useVm = true;
+    } else if (option == "--out" && arg + 1 < argc) {
+      path = argv[++arg];
+    } else {
+      only.push_back(option);
+    }
+  }
+
+  initGrammar();
+
+  std::ostringstream json;
+  json << "{\n  \"evaluator\": " << quote(useVm ? "vm" : "tree") 
+       << ",\n  \"benchmarks\": [";
+
+  const char* separator = "\n";
+  for (auto& benchmark : benchmarks()) {
+    if (!only.empty() && 
+        std::find(only.begin(), only.end(), benchmark.name) == only.end()) {
+      continue;
+    }
+
+    Result      result = {};
+    std::string error;
+    bool        ok = true;
+    size_t      runs = benchmark.op.empty() ? startupRuns : 1;
+
+    // Startup is short, so it is averaged over several children
+    for (size_t run = 0; run < runs && ok; run++) {
+      Result one;
+      ok = runChild(benchmark, one, error);
+      if (ok) {
+        result.nsPerOp     += one.nsPerOp / runs;
+        result.allocsPerOp  = one.allocsPerOp;
+        result.peakRssKb    = std::max(result.peakRssKb, one.peakRssKb);
+        result.ops         += one.ops;
+      }
+    }
+
+    json << separator << "    {\"name\": " << quote(benchmark.name);
+    if (ok) {
+      json << std::fixed << std::setprecision(1)
+           << ", \"ns_per_op\": "     << result.nsPerOp
+           << ", \"allocs_per_op\": " << result.allocsPerOp
+           << ", \"peak_rss_kb\": "   << result.peakRssKb
+           << ", \"ops\": "           << result.ops << "}";
+      std::cerr << std::left << std::setw(16) << benchmark.name 
+                << std::right << std::fixed << std::setprecision(1) 
+                << std::setw(16) << result.nsPerOp << " ns/op"
+                << std::setw(12) << result.allocsPerOp << " allocs/op"
+                << std::setw(10) << result.peakRssKb << " KB peak" 
+                << std::endl;
+    } else {
+      json << ", \"error\": " << quote(error) << "}";
+      std::cerr << std::left << std::setw(16) << benchmark.name 
+                << error << std::endl;
+    }
+    separator = ",\n";
+  }
+  json << "\n  ]\n}\n";
+
+  std::ofstream out(path);
+  if (!out) {
+    std::cerr << "Couldn't write " << path << "!" << std::endl;
+    return 1;
+  }
+  out << json.str();
+  return 0;
+}
+
+//------------------------------------------------------------------------------
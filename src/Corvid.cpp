@@ -25,6 +25,7 @@
 */
 
 #include "Corvid.h"
+#include "Resolver.h"
 
 #include <cmath>
 #include <fstream>
@@ -33,99 +34,373 @@ using namespace corvid;
 
 //------------------------------------------------------------------------------
 
-Expr* evalProcForm(List* pList, Scope* pScope) {
-  pScope = pScope->extend();
-  auto pHead = pList->pHead->eval(pScope);
-  return as<Fun>(pHead)->fun(pList->pTail, pScope);
+void checkArity(Lambda* pLambda, size_t count) {
+  if (count > pLambda->params.size()) {
+    throw std::runtime_error("Too many arguments to lambda!");
+  }
+}
+
+// Arguments are evaluated by the caller and land in the frame's slots
+void bindArguments(Lambda* pLambda, Scope* pFrame, 
+                   List* pArgs, Scope* pCaller) {
+  size_t arg = 0;
+  for (; pArgs && pArgs->pHead; pArgs = pArgs->pTail, arg++) {
+    checkArity(pLambda, arg + 1);
+    pFrame->slots_[arg] = evalExpr(pArgs->pHead, pCaller);
+  }
+}
+
+Expr* makeLambda(Lambda* pLambda, Scope* pScope);
+Expr* evalLoop(Expr* pExpr, Scope* pScope);
+
+#include "Profiler.h"
+
+#ifdef CORVID_JIT
+#include "Jit.h"
+#endif
+
+// Runs the body of a lambda in a frame holding its arguments
+Expr* enterLambda(Fun* pFun, Scope* pFrame) {
+  CallFrame call;
+  call.enter(pFun);
+
+#ifdef CORVID_JIT
+  if (jit.tierUp(pFun)) {
+    auto pResult = jit.run(pFun, pFrame);
+    return TailCall::is(pResult) ? evalLoop(pResult, pFrame) : pResult;
+  }
+#endif
+  return evalExpr(pFun->pLambda->pBody, pFrame);
 }
 
-Expr* makeLambda(List* pArgs, Expr* pLambda, Scope* pScope) {
+Expr* makeLambda(Lambda* pLambda, Scope* pScope) {
 
   // Create a new procedure that evaluates the lambda expression
-  return new Fun([=](List* Args, Scope* Scope) {
-    // Create a new scope for our lambda
-    auto pClosure = Scope->extend();
-
-    int arg = 0;
-    Args->each ([&](Expr* pExpr) {
-      auto pArgValue = pExpr->eval(pClosure);
-      pClosure->setValue(as<Sym>(pArgs->get(arg))->sym, pArgValue);
-      arg++;
-    });
-
-    return pLambda->eval(pClosure);
-  });
+  auto pFun = new Fun(Fun::Form());
+  pFun->fun = [=](List* pArgs, Scope* pCaller) {
+    RootScope roots;
+
+    auto pFrame = pScope->extend(pLambda->frameSize);
+    FrameScope frame(pFrame);
+    gc.root(pFrame);
+    bindArguments(pLambda, pFrame, pArgs, pCaller);
+
+    return enterLambda(pFun, pFrame);
+  };
+
+  pFun->call = [=](Expr** ppArgs, size_t count) {
+    checkArity(pLambda, count);
+
+    RootScope roots;
+    auto pFrame = pScope->extend(pLambda->frameSize);
+    FrameScope frame(pFrame);
+    gc.root(pFrame);
+    std::copy(ppArgs, ppArgs + count, pFrame->slots_.begin());
+    return enterLambda(pFun, pFrame);
+  };
+
+  pFun->pLambda = pLambda;
+  pFun->pEnv    = pScope;
+  pScope->escape();
+
+  return pFun->capture(pLambda)->capture(pScope);
 }
 
+Expr* Lambda::eval(Scope* pScope) {
+  return makeLambda(this, pScope);
+}
+
+// Forms that reach these have not been through the Resolver (it rewrites them
+// ahead of time), so resolve them now
 Expr* evalLambdaForm(List* pList, Scope* pScope) {
-  auto pLambdaArgs = as<List>(pList->get(1));
-  auto pLambdaExpr = as<Expr>(pList->get(2));
-  return makeLambda(pLambdaArgs, pLambdaExpr, pScope);
+  return evalExpr(resolve(pList), pScope);
 }
 
 Expr* evalDefineForm(List* pList, Scope* pScope) {
-  if (pList->get(1)->pAtom) {
-    auto pName  = as<Sym>(pList->get(1));
-    auto pValue = pList->get(2)->eval(pScope);
-    pScope->setValue(pName->sym, pValue);
-    return pValue;
-  } else  {
-    auto pArgs       = as<List>(pList->get(1));
-    auto pLambdaExpr = as<List>(pList->get(2));
-    auto pName       = as<Sym> (pArgs->pHead);
-    auto pLambdaArgs = as<List>(pArgs->pTail);
-    auto pLambda     = makeLambda(pLambdaArgs, pLambdaExpr, pScope);
-    pScope->setValue(pName->sym, pLambda);
-    return pLambda;
+  auto pName = pList->get(1);
+  if (List::is(pName)) {
+    return evalExpr(resolve(pList), pScope);
+  }
+
+  auto pValue = evalExpr(pList->get(2), pScope);
+  if (Local::is(pName)) {
+    pScope->getSlot(pName) = pValue;
+  } else {
+    nameFun(pValue, as<Sym>(pName));
+    pScope->setValue(as<Sym>(pName), pValue);
   }
+  return pValue;
+}
+
+Expr* evalSetForm(List* pList, Scope* pScope) {
+  auto pName  = pList->get(1);
+  auto pValue = evalExpr(pList->get(2), pScope);
+  if (Local::is(pName)) {
+    pScope->getSlot(pName) = pValue;
+  } else {
+    pScope->assign(as<Sym>(pName), pValue);
+  }
+  return pValue;
 }
 
 Expr* evalQuoteForm(List* pList, Scope* pScope) {
   return pList->get(1);
 }
 
-Expr* evalIfForm(List* pList, Scope* pScope) {
-  auto pCondition = pList->get(1)->eval(pScope);
+// The branch an if evaluates to, which is left to the caller so that it stays
+// in tail position
+Expr* selectBranch(List* pList, Scope* pScope) {
+  auto pCondition = evalExpr(pList->get(1), pScope);
 
-  if (!pCondition->pList) {
-    return pList->get(2)->eval(pScope);
+  if (!List::is(pCondition)) {
+    return pList->get(2);
   } else {
-    return pList->get(3)->eval(pScope);
+    return pList->get(3);
   }
 }
 
-Expr* evalList(List* pList, Scope* pScope) {
-  return pList->eval(pScope);
+Expr* evalIfForm(List* pList, Scope* pScope) {
+  return evalExpr(selectBranch(pList, pScope), pScope);
 }
 
-Expr* List::eval (Scope* pScope) {
-  // If our list has no first element 
-  if (!get(0)) {
-    return this;
+// Likewise the last form of a begin
+Expr* evalLeading(List* pList, Scope* pScope) {
+  auto pForms = pList->pTail;
+  if (!pForms || !pForms->pHead) {
+    return nil;
+  }
+
+  for (; pForms->pTail && pForms->pTail->pHead; pForms = pForms->pTail) {
+    evalExpr(pForms->pHead, pScope);
+  }
+  return pForms->pHead;
+}
+
+Expr* evalBeginForm(List* pList, Scope* pScope) {
+  return evalExpr(evalLeading(pList, pScope), pScope);
+}
+
+bool isNumber(Expr* pExpr) {
+  return Int::is(pExpr) || Float::is(pExpr);
+}
+
+Expr* evalIntrinsic(Intrinsic op, int a, int b) {
+  switch (op) {
+    case INT_ADD: return Int::box(a + b);
+    case INT_SUB: return Int::box(a - b);
+    case INT_MUL: return Int::box(a * b);
+    case INT_DIV: return Int::box(a / b);
+    case INT_MOD: return Int::box(a % b);
+    case INT_EQ:  return a == b ? Int::box(1) : nil;
+    case INT_LT:  return a <  b ? Int::box(1) : nil;
+    case INT_GT:  return a >  b ? Int::box(1) : nil;
+    default:      throw std::runtime_error("Unknown intrinsic!");
+  }
+}
+
+// Call nodes are shared by every thread running the code, so while a parallel
+// section or future runs they take the fast path where they can but never 
+// change state.
+Expr* Call::specialized(Fun* pFun, Scope* pScope) {
+  bool shared = gc.isShared();
+  if (state == UNINITIALIZED) {
+    if (!pFun->intrinsic || argc != 2) {
+      if (!shared) {
+        state = GENERIC;
+      }
+      return 0;
+    }
+  } else if (pFun != pCached) {
+    if (!shared) {
+      state = GENERIC;
+    }
+    return 0;
+  }
+
+  Expr* ppArgs[2];
+  ppArgs[0] = rootExpr(evalExpr(pForm->get(1), pScope));
+  ppArgs[1] = rootExpr(evalExpr(pForm->get(2), pScope));
+
+  // Numeric literals are read as floats, which the natives truncate, so a
+  // float is as good as an int here.  Division by zero is left to the native.
+  bool ints = isNumber(ppArgs[0]) && isNumber(ppArgs[1]) && 
+    !((pFun->intrinsic == INT_DIV || pFun->intrinsic == INT_MOD) && 
+      as<Int>(ppArgs[1]) == 0);
+
+  if (state == UNINITIALIZED && !shared) {
+    state   = ints ? SPECIALIZED : GENERIC;
+    pCached = pFun;
+  } else if (ints) {
+    return evalIntrinsic(pFun->intrinsic, 
+                         as<Int>(ppArgs[0]), as<Int>(ppArgs[1]));
+  } else if (!shared) {
+    state = GENERIC;
   }
 
-  if (get(0) && get(0)->pAtom && get(0)->pAtom->pSym) {
-    auto pSym = get(0)->pAtom->pSym;
-    if (pSym->sym == "define") {
-      return evalDefineForm(this, pScope);
+  return pFun->call(ppArgs, 2);
+}
+
+// Expressions in tail position (the branches of an if, the last form of a 
+// begin and the body of a lambda) are evaluated by going round the loop 
+// rather than recursing, and a tail call to a lambda rebinds the frame of the
+// one making it when no closure has captured it.  Compiled code hands back 
+// the tail calls it makes to other lambdas, and they go round the loop too.
+Expr* evalLoop(Expr* pExpr, Scope* pScope) {
+  RootScope  roots;
+  CallFrame  call;
+  FrameScope frame;
+  Scope*&    pFrame = frame.pFrame_;
+
+  // Binds the arguments of a call to pFun in a frame and carries on with its
+  // body, or returns the value if its code has been compiled
+  auto enter = [&](Fun* pFun, Expr** ppArgs, size_t count) -> Expr* {
+    auto pLambda = pFun->pLambda;
+    checkArity(pLambda, count);
+
+    if (pScope == pFrame &&
+        pFrame->recyclable(pFun->pEnv, pLambda->frameSize)) {
+      auto end = std::copy(ppArgs, ppArgs + count, pFrame->slots_.begin());
+      std::fill(end, pFrame->slots_.end(), nil);
+    } else {
+      auto pCallee = pFun->pEnv->extend(pLambda->frameSize);
+      gc.root(pCallee);
+      std::copy(ppArgs, ppArgs + count, pCallee->slots_.begin());
+
+      // The arguments were the last thing the frame we had was needed for
+      if (pFrame) {
+        pFrame->release();
+      }
+      pFrame = pCallee;
+    }
+    call.enter(pFun);
+
+    pScope = pFrame;
+    pExpr  = pLambda->pBody;
+#ifdef CORVID_JIT
+    if (jit.tierUp(pFun)) {
+      auto pResult = jit.run(pFun, pFrame);
+      if (!TailCall::is(pResult)) {
+        return pResult;
+      }
+      pExpr = pResult;
+    }
+#endif
+    return 0;
+  };
+
+  for (;;) {
+    gc.release(roots.depth_);
+    gc.root(pScope);
+    rootExpr(pExpr);
+
+#ifdef CORVID_JIT
+    // Made from the frame of the code that handed it back
+    if (TailCall::is(pExpr)) {
+      auto pTailCall = static_cast<TailCall*>(pExpr);
+      if (auto pResult = enter(pTailCall->pFun, pTailCall->args.data(), 
+                               pTailCall->args.size())) {
+        return pResult;
+      }
+      continue;
+    }
+#endif
+
+    Call* pCall = 0;
+    List* pList = 0;
+    if (Call::is(pExpr)) {
+      pCall = static_cast<Call*>(pExpr);
+      pList = pCall->pForm;
+    } else if (List::is(pExpr)) {
+      pList = static_cast<List*>(pExpr);
+    } else {
+      return evalExpr(pExpr, pScope);
+    }
+
+    // If our list has no first element 
+    if (!pList->pHead) {
+      return pList;
+    }
+
+    if (auto form = pCall ? 0 : getSpecialForm(pList->pHead)) {
+      countSpecialForm(pList->pHead);
+      if (form == &evalIfForm) {
+        pExpr = selectBranch(pList, pScope);
+      } else if (form == &evalBeginForm) {
+        pExpr = evalLeading(pList, pScope);
+      } else {
+        return form(pList, pScope);
+      }
+      continue;
     }
-    if (pSym->sym == "lambda" || pSym->sym == ".\\") {
-      return evalLambdaForm(this, pScope);
+
+    // Everything live in the C++ frames above us has been rooted
+    gc.poll();
+
+    auto pFun = as<Fun>(rootExpr(evalExpr(pList->pHead, pScope)));
+    if (pCall && pCall->state != Call::GENERIC) {
+      if (auto pResult = pCall->specialized(pFun, pScope)) {
+        return pResult;
+      }
     }
-    if (pSym->sym == "quote") {
-      return evalQuoteForm(this, pScope);
+
+    auto pLambda = pFun->pLambda;
+    if (!pLambda) {
+      metrics().nativeCalls.bump();
+      return pFun->fun(pList->pTail, pScope);
     }
-    if (pSym->sym == "if") {
-      return evalIfForm(this, pScope);
+
+    // The arguments come first: a closure made by one of them captures our
+    // frame, which then can't be rebound
+    Arguments args(pList->pTail, pScope);
+    if (auto pResult = enter(pFun, args.data(), args.size())) {
+      return pResult;
     }
   }
+}
+
+Expr* List::eval (Scope* pScope) {
+  return evalLoop(this, pScope);
+}
 
-  return evalProcForm(this, pScope);
+Expr* Call::eval (Scope* pScope) {
+  return evalLoop(this, pScope);
 }
 
-std::unique_ptr<Scope> pGlobalScope;
+Scope* pGlobalScope;
 
 #include "Bindings.h"
+#include "Memo.h"
+#include "PersistentVector.h"
+#include "Vm.h"
+#include "Parallel.h"
+#include "Future.h"
+#include "Green.h"
+#include "Folder.h"
+
+Expr* evalTopLevel(Expr* pExpr) {
+  auto start = std::chrono::steady_clock::now();
+  struct Timer {
+    ~Timer() {
+      metrics().evalMicros.observe(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start).count());
+    }
+    std::chrono::steady_clock::time_point start;
+  } timer = { start };
+
+  if (useVm) {
+    return pVm->eval(pExpr, pGlobalScope);
+  }
+  return evalExpr(pExpr, pGlobalScope);
+}
+
+#include "Expander.h"
+
+// What is evaluated of each form read: its macros expanded, its variables
+// resolved and its constant calls folded
+Expr* prepare(Expr* pExpr) {
+  return fold(resolve(expand(pExpr)));
+}
 
 int opAdd(int a, int b) { return a + b; }
 int opSub(int a, int b) { return a - b; }
@@ -134,12 +409,28 @@ int opDiv(int a, int b) { return a / b; }
 int opMod(int a, int b) { return a % b; }
 float opSin(float a)    { return sin(a); }
 
+// Arithmetic takes any further arguments and folds them in from the left
+template <int (*OP)(int, int)>
+int opFold(int a, int b, Rest rest) {
+  auto result = OP(a, b);
+  for (size_t i = 0; i < rest.count; i++) {
+    result = OP(result, Unpack<int>::get(rest.ppArgs[i]));
+  }
+  return result;
+}
+
 bool opEq(int a, int b) { return a == b; }
-bool opEqs(std::string a, std::string b) { return a == b; }
+bool opEqs(const std::string& a, const std::string& b) { return a == b; }
 bool opLt(int a, int b) { return a <  b; }
 bool opGt(int a, int b) { return a >  b; }
 
-void load(std::string path);
+void load(const std::string& path);
+
+void expectArgs(size_t count, size_t expected) {
+  if (count < expected) {
+    throw std::runtime_error("Too few arguments!");
+  }
+}
 
 int len  (List* pArgs) {
     return pArgs->length();
@@ -149,77 +440,464 @@ std::string fill  (int n, List* pArgs) {
     return "implemented"; 
 }
 
-void dumpEnv(int n) {
+void dumpEnv() {
   for (auto sym : pGlobalScope->symbols_) {
-    std::cout << sym.first << " = ";
-    sym.second->print();
+    std::cout << symbols.name(sym.first) << " = ";
+    printExpr(sym.second);
     std::cout << std::endl;
   }
 }
 
+// The metrics as an association list; counts by type or form are nested in
+// one of their own, histograms are lists of bucket counts
+List* stats() {
+  auto totals = metricsRegistry.totals();
+  auto pair   = [](const std::string& name, Expr* pValue) {
+    return new List(Sym::intern(name), new List(pValue, nil));
+  };
+  auto counts = [&](const std::vector<std::string>& names, 
+                    const std::function<uint64_t(size_t)>& count) {
+    auto pList = nil;
+    for (size_t i = names.size(); i--; ) {
+      pList = new List(pair(names[i], Int::box(count(i))), pList);
+    }
+    return pList;
+  };
+  auto buckets = [](const uint64_t* pCounts, size_t size) {
+    auto pList = nil;
+    for (size_t i = size; i--; ) {
+      pList = new List(Int::box(pCounts[i]), pList);
+    }
+    return pList;
+  };
+
+  auto& types = metricsRegistry.types;
+  auto& forms = metricsRegistry.forms;
+  std::vector<Expr*> rows = {
+    pair("allocations", counts(types, [&](size_t i) { 
+      return totals.allocs[i]; 
+    })),
+    pair("live", counts(types, [&](size_t i) { 
+      return totals.allocs[i] - totals.frees[i]; 
+    })),
+    pair("scopes",       Int::box(totals.scopes)),
+    pair("live-scopes",  Int::box(totals.scopes - totals.freedScopes)),
+    pair("forms", counts(forms, [&](size_t i) { 
+      return totals.forms[i]; 
+    })),
+    pair("native-calls", Int::box(totals.nativeCalls)),
+    pair("type-errors",  Int::box(totals.typeErrors)),
+    pair("lookup-depth", buckets(totals.lookupDepth, 9)),
+    pair("eval-us",      buckets(totals.evalMicros, 26)),
+  };
+
+  auto pTable = nil;
+  for (auto it = rows.rbegin(); it != rows.rend(); ++it) {
+    pTable = new List(*it, pTable);
+  }
+  return pTable;
+}
+
+// Builtins whose result depends on nothing but their arguments, which the
+// Folder can call ahead of time
+Fun* pure(Fun* pFun) {
+  pFun->pure = true;
+  return pFun;
+}
+
+template <typename R, typename...S>
+Fun* intrinsic(R (*f)(S...), Intrinsic op) {
+  auto pFun = pure(Fun::native(f));
+  pFun->intrinsic = op;
+  return pFun;
+}
+
+// Packs numbers, or a single list or vector of them, into an array
+template <ArrayElem ELEM>
+Array* makeArray(Rest rest) {
+  std::vector<Expr*> items;
+  if (rest.count == 1 && List::is(rest.ppArgs[0])) {
+    for (auto pList = static_cast<List*>(rest.ppArgs[0]); pList->pTail; 
+         pList = pList->pTail) {
+      items.push_back(pList->pHead);
+    }
+  } else if (rest.count == 1 && Vector::is(rest.ppArgs[0])) {
+    items = static_cast<Vector*>(rest.ppArgs[0])->items;
+  } else {
+    items.assign(rest.ppArgs, rest.ppArgs + rest.count);
+  }
+
+  auto pArray = new Array(ELEM, items.size());
+  for (size_t i = 0; i < items.size(); i++) {
+    pArray->set(i, Unpack<double>::get(items[i]));
+  }
+  return pArray;
+}
+
+void checkShapes(Array* pA, Array* pB) {
+  if (pA->elem != pB->elem) {
+    throw std::runtime_error("Array types differ!");
+  }
+  if (pA->size != pB->size) {
+    throw std::runtime_error("Array sizes differ!");
+  }
+}
+
+template <BinaryOp OP>
+Array* arrayBinary(Array* pA, Array* pB) {
+  checkShapes(pA, pB);
+  auto pOut = new Array(pA->elem, pA->size);
+  simdBinary(OP, pA->elem, pOut->pData, pA->pData, pB->pData, pA->size);
+  return pOut;
+}
+
+template <CompareOp OP>
+Array* arrayCompare(Array* pA, Array* pB) {
+  checkShapes(pA, pB);
+  auto pOut = new Array(maskElem(pA->elem), pA->size);
+  simdCompare(OP, pA->elem, pOut->pData, pA->pData, pB->pData, pA->size);
+  return pOut;
+}
+
+Expr* boxElem(ArrayElem elem, double value) {
+  if (elem == F32 || elem == F64) {
+    return Float::box(value);
+  }
+  return Int::box(value);
+}
+
+template <ReduceOp OP>
+Expr* arrayReduce(Array* pA) {
+  return boxElem(pA->elem, simdReduce(OP, pA->elem, pA->pData, 0, pA->size));
+}
+
+Expr* arrayDot(Array* pA, Array* pB) {
+  checkShapes(pA, pB);
+  return boxElem(pA->elem, 
+                 simdReduce(DOT, pA->elem, pA->pData, pB->pData, pA->size));
+}
+
+Array* arrayAxpy(double alpha, Array* pX, Array* pY) {
+  checkShapes(pX, pY);
+  auto pOut = new Array(pX->elem, pX->size);
+  simdAxpy(pX->elem, pOut->pData, alpha, pX->pData, pY->pData, pX->size);
+  return pOut;
+}
+
+List* arrayToList(Array* pArray) {
+  auto pList = nil;
+  for (size_t i = pArray->size; i > 0; i--) {
+    pList = new List(pArray->get(i - 1), pList);
+  }
+  return pList;
+}
+
+// Alternating keys and values
+Dict* makeDict(Rest rest) {
+  if (rest.count % 2) {
+    throw std::runtime_error("Dict needs a value for every key!");
+  }
+
+  auto pDict = new Dict();
+  for (size_t i = 0; i < rest.count; i += 2) {
+    pDict->set(rest.ppArgs[i], rest.ppArgs[i + 1]);
+  }
+  return pDict;
+}
+
+Expr* dictGet(Dict* pDict, Expr* pKey, Optional<Expr*> fallback) {
+  auto pValue = pDict->get(pKey);
+  return pValue ? pValue : fallback.valueOr(nil);
+}
+
+Expr* dictSet(Dict* pDict, Expr* pKey, Expr* pValue) {
+  pDict->set(pKey, pValue);
+  return pValue;
+}
+
+bool dictHas(Dict* pDict, Expr* pKey) {
+  return pDict->get(pKey) != 0;
+}
+
+// Keys or values, in table order
+List* dictItems(Dict* pDict, bool keys) {
+  auto pList = nil;
+  for (auto& slot : pDict->slots) {
+    if (slot.pKey) {
+      pList = new List(keys ? slot.pKey : slot.pValue, pList);
+    }
+  }
+  return pList;
+}
+
+// Calls f with each key and value.  The entries are copied first so f can 
+// change the dict.
+void dictForEach(Dict* pDict, Fun* pFun) {
+  if (!pFun->call) {
+    typeError("Type error: dict-for-each needs a function!");
+  }
+
+  RootScope roots;
+  std::vector<Expr*> entries;
+  for (auto& slot : pDict->slots) {
+    if (slot.pKey) {
+      entries.push_back(rootExpr(slot.pKey));
+      entries.push_back(rootExpr(slot.pValue));
+    }
+  }
+
+  for (size_t i = 0; i < entries.size(); i += 2) {
+    pFun->call(&entries[i], 2);
+  }
+}
+
 void initGlobalScope() {
-  pGlobalScope.reset(new Scope(0));
+  pGlobalScope = new Scope(0);
   nil = new List();
+
+  defineSpecialForm("define", &evalDefineForm);
+  defineSpecialForm("lambda", &evalLambdaForm);
+  defineSpecialForm(".\\",     &evalLambdaForm);
+  defineSpecialForm("quote",  &evalQuoteForm);
+  defineSpecialForm("if",     &evalIfForm);
+  defineSpecialForm("set!",   &evalSetForm);
+  defineSpecialForm("begin",  &evalBeginForm);
+  defineSpecialForm("future", &evalFutureForm);
+  defineSpecialForm("profile", &evalProfileForm);
+
+  for (size_t type = 0; type < Expr::TYPES; type++) {
+    metricsRegistry.nameType(type, typeName(Expr::Type(type)));
+  }
+
+  gc.addRoots([](Gc& gc) {
+    gc.mark(pGlobalScope);
+    gc.mark(nil);
+  });
   
-  pGlobalScope->setValue("+",       Fun::native(&opAdd)); 
-  pGlobalScope->setValue("-",       Fun::native(&opSub)); 
-  pGlobalScope->setValue("*",       Fun::native(&opMul)); 
-  pGlobalScope->setValue("/",       Fun::native(&opDiv)); 
-  pGlobalScope->setValue("%",       Fun::native(&opMod)); 
-  pGlobalScope->setValue("=",       Fun::native(&opEq)); 
-  pGlobalScope->setValue("s=",       Fun::native(&opEqs)); 
-  pGlobalScope->setValue("<",       Fun::native(&opLt)); 
-  pGlobalScope->setValue(">",       Fun::native(&opGt)); 
-  pGlobalScope->setValue("sin",     Fun::native(&opSin)); 
+  pGlobalScope->setValue("+",       intrinsic(&opFold<&opAdd>, INT_ADD)); 
+  pGlobalScope->setValue("-",       intrinsic(&opFold<&opSub>, INT_SUB)); 
+  pGlobalScope->setValue("*",       intrinsic(&opFold<&opMul>, INT_MUL)); 
+  pGlobalScope->setValue("/",       intrinsic(&opFold<&opDiv>, INT_DIV)); 
+  pGlobalScope->setValue("%",       intrinsic(&opMod, INT_MOD)); 
+  pGlobalScope->setValue("=",       intrinsic(&opEq,  INT_EQ)); 
+  pGlobalScope->setValue("s=",      pure(Fun::native(&opEqs))); 
+  pGlobalScope->setValue("<",       intrinsic(&opLt,  INT_LT)); 
+  pGlobalScope->setValue(">",       intrinsic(&opGt,  INT_GT)); 
+  pGlobalScope->setValue("sin",     pure(Fun::native(&opSin))); 
   pGlobalScope->setValue("len",     Fun::native(&len)); 
   pGlobalScope->setValue("fill",    Fun::native(&fill)); 
   pGlobalScope->setValue("dumpenv", Fun::native(&dumpEnv)); 
   pGlobalScope->setValue("load",    Fun::native(&load)); 
 
-  pGlobalScope->setValue("cons",  new Fun([](List* pArgs, Scope* pScope) {
-    auto pHead = pArgs->get(0)->eval(pScope);
-    auto pTail = pArgs->get(1)->eval(pScope)->pList;
-    return new List(pHead, pTail);
+  pGlobalScope->setValue("cons",  Fun::strict([](Expr** ppArgs, size_t count) {
+    expectArgs(count, 2);
+    return new List(ppArgs[0], as<List>(ppArgs[1]));
   }));
-  pGlobalScope->setValue("head",  new Fun([](List* pArgs, Scope* pScope) {
-    return pArgs->get(0)->eval(pScope)->pList->head();
+  pGlobalScope->setValue("head",  Fun::strict([](Expr** ppArgs, size_t count) {
+    expectArgs(count, 1);
+    return as<List>(ppArgs[0])->head();
   }));
-  pGlobalScope->setValue("tail",  new Fun([](List* pArgs, Scope* pScope) {
-    return pArgs->get(0)->eval(pScope)->pList->tail();
+  pGlobalScope->setValue("tail",  Fun::strict([](Expr** ppArgs, size_t count) {
+    expectArgs(count, 1);
+    return as<List>(ppArgs[0])->tail();
   }));
-  pGlobalScope->setValue("list",  new Fun([](List* pArgs, Scope* pScope) {
-    return pArgs;
+  pGlobalScope->setValue("list",  Fun::native([](Rest rest) {
+    auto pList = nil;
+    while (rest.count) {
+      pList = new List(rest.ppArgs[--rest.count], pList);
+    }
+    return pList;
   }));
-  pGlobalScope->setValue("len",  new Fun([](List* pArgs, Scope* pScope) {
-    auto len = pArgs->get(0)->eval(pScope)->pList->length();
-    return new Int(len);
+  pGlobalScope->setValue("len",  Fun::strict([](Expr** ppArgs, size_t count) {
+    expectArgs(count, 1);
+    return Int::box(as<List>(ppArgs[0])->length());
   }));
-  pGlobalScope->setValue("nth",  new Fun([](List* pArgs, Scope* pScope) {
-    auto i     = pArgs->get(0)->eval(pScope)->pAtom->pInt->num;
-    auto pList = pArgs->get(1)->eval(pScope)->pList; 
+  pGlobalScope->setValue("nth",  Fun::strict([](Expr** ppArgs, size_t count) {
+    expectArgs(count, 2);
+    auto i     = as<Int>(ppArgs[0]);
+    auto pList = as<List>(ppArgs[1]); 
     return pList->get(i);
   }));
-  pGlobalScope->setValue("nil?",  new Fun([](List* pArgs, Scope* pScope) -> Expr* {
-    auto len = pArgs->get(0)->eval(pScope)->pList->length();
-    bool result = len == 0; 
+  pGlobalScope->setValue("nil?",  Fun::strict([](Expr** ppArgs, size_t count) -> Expr* {
+    expectArgs(count, 1);
+    bool result = !as<List>(ppArgs[0])->pTail; 
     if (result) {
-      return new Int(1);
+      return Int::box(1);
     } else {
       return nil;
     }
   }));
-  pGlobalScope->setValue("set!",  new Fun([](List* pArgs, Scope* pScope) {
-    auto pName  = pArgs->get(0)->pAtom->pSym;
-    auto pValue = pArgs->get(1)->eval(pScope); 
-    pScope->setValue(pName->sym, pValue);
-    return pValue;
+  pGlobalScope->setValue("vector",  Fun::native([](Rest rest) {
+    return new Vector(rest.ppArgs, rest.count);
+  }));
+  pGlobalScope->setValue("vec-ref",  Fun::strict([](Expr** ppArgs, size_t count) {
+    expectArgs(count, 2);
+    return as<Vector>(ppArgs[0])->at(as<Int>(ppArgs[1]));
+  }));
+  pGlobalScope->setValue("vec-len",  Fun::strict([](Expr** ppArgs, size_t count) {
+    expectArgs(count, 1);
+    return Int::box(as<Vector>(ppArgs[0])->items.size());
+  }));
+  pGlobalScope->setValue("vec-set!",  Fun::strict([](Expr** ppArgs, size_t count) {
+    expectArgs(count, 3);
+    return as<Vector>(ppArgs[0])->at(as<Int>(ppArgs[1])) = ppArgs[2];
+  }));
+  pGlobalScope->setValue("vec-push!",  Fun::strict([](Expr** ppArgs, size_t count) {
+    expectArgs(count, 2);
+    auto pVector = as<Vector>(ppArgs[0]);
+    pVector->items.push_back(ppArgs[1]);
+    return pVector;
+  }));
+  pGlobalScope->setValue("list->vector",  Fun::strict([](Expr** ppArgs, size_t count) {
+    expectArgs(count, 1);
+    auto pVector = new Vector();
+    for (auto pList = as<List>(ppArgs[0]); pList->pTail; pList = pList->pTail) {
+      pVector->items.push_back(pList->pHead);
+    }
+    return pVector;
+  }));
+  pGlobalScope->setValue("vector->list",  Fun::strict([](Expr** ppArgs, size_t count) {
+    expectArgs(count, 1);
+    auto& items = as<Vector>(ppArgs[0])->items;
+    auto  pList = nil;
+    for (auto it = items.rbegin(); it != items.rend(); ++it) {
+      pList = new List(*it, pList);
+    }
+    return pList;
+  }));
+  pGlobalScope->setValue("f32",         Fun::native(&makeArray<F32>));
+  pGlobalScope->setValue("f64",         Fun::native(&makeArray<F64>));
+  pGlobalScope->setValue("i32",         Fun::native(&makeArray<I32>));
+  pGlobalScope->setValue("i64",         Fun::native(&makeArray<I64>));
+  pGlobalScope->setValue("array-len",   Fun::native([](Array* pArray) {
+    return int(pArray->size);
+  }));
+  pGlobalScope->setValue("array-ref",   Fun::native([](Array* pArray, int i) {
+    return pArray->get(i);
+  }));
+  pGlobalScope->setValue("array-set!",  Fun::native([](Array* pArray, int i, 
+                                                       double value) {
+    pArray->set(i, value);
+    return pArray->get(i);
+  }));
+  pGlobalScope->setValue("array->list", Fun::native(&arrayToList));
+  pGlobalScope->setValue("array+",      Fun::native(&arrayBinary<ADD>));
+  pGlobalScope->setValue("array-",      Fun::native(&arrayBinary<SUB>));
+  pGlobalScope->setValue("array*",      Fun::native(&arrayBinary<MUL>));
+  pGlobalScope->setValue("array/",      Fun::native(&arrayBinary<DIV>));
+  pGlobalScope->setValue("array-min",   Fun::native(&arrayBinary<MIN>));
+  pGlobalScope->setValue("array-max",   Fun::native(&arrayBinary<MAX>));
+  pGlobalScope->setValue("array<",      Fun::native(&arrayCompare<LT>));
+  pGlobalScope->setValue("array>",      Fun::native(&arrayCompare<GT>));
+  pGlobalScope->setValue("array=",      Fun::native(&arrayCompare<EQ>));
+  pGlobalScope->setValue("axpy",        Fun::native(&arrayAxpy));
+  pGlobalScope->setValue("dot",         Fun::native(&arrayDot));
+  pGlobalScope->setValue("sum",         Fun::native(&arrayReduce<SUM>));
+  pGlobalScope->setValue("min",         Fun::native(&arrayReduce<LEAST>));
+  pGlobalScope->setValue("max",         Fun::native(&arrayReduce<GREATEST>));
+  pGlobalScope->setValue("memoize",     Fun::native(&memoize));
+  pGlobalScope->setValue("memo-stats",  Fun::native(&memoStats));
+  pGlobalScope->setValue("dict",        Fun::native(&makeDict));
+  pGlobalScope->setValue("dict-get",    Fun::native(&dictGet));
+  pGlobalScope->setValue("dict-set!",   Fun::native(&dictSet));
+  pGlobalScope->setValue("dict-has?",   Fun::native(&dictHas));
+  pGlobalScope->setValue("dict-len",    Fun::native([](Dict* pDict) {
+    return int(pDict->count);
+  }));
+  pGlobalScope->setValue("dict-keys",   Fun::native([](Dict* pDict) {
+    return dictItems(pDict, true);
+  }));
+  pGlobalScope->setValue("dict-values", Fun::native([](Dict* pDict) {
+    return dictItems(pDict, false);
+  }));
+  pGlobalScope->setValue("dict-for-each", Fun::native(&dictForEach));
+  pGlobalScope->setValue("pvec",        Fun::native([](Rest rest) {
+    auto pTransient = new Transient(PTrie());
+    for (size_t i = 0; i < rest.count; i++) {
+      pTransient->conj(rest.ppArgs[i]);
+    }
+    return pTransient->persistent();
+  }));
+  pGlobalScope->setValue("pvec-ref",    Fun::native([](PVec* pVec, int i) {
+    return pVec->trie.get(i);
+  }));
+  pGlobalScope->setValue("pvec-len",    Fun::native([](PVec* pVec) {
+    return int(pVec->trie.count);
+  }));
+  pGlobalScope->setValue("conj",        Fun::native([](PVec* pVec, Expr* pValue) {
+    return pVec->conj(pValue);
+  }));
+  pGlobalScope->setValue("assoc",       Fun::native([](PVec* pVec, int i, 
+                                                       Expr* pValue) {
+    return pVec->assoc(i, pValue);
+  }));
+  pGlobalScope->setValue("from-list",   Fun::native([](List* pList) {
+    return into(new PVec(), pList);
+  }));
+  pGlobalScope->setValue("into",        Fun::native(&into));
+  pGlobalScope->setValue("pvec->list",  Fun::native(&pvecToList));
+  pGlobalScope->setValue("transient",   Fun::native([](PVec* pVec) {
+    return new Transient(pVec->trie);
+  }));
+  pGlobalScope->setValue("conj!",       Fun::native(&Transient::conj));
+  pGlobalScope->setValue("assoc!",      Fun::native(&Transient::assoc));
+  pGlobalScope->setValue("persistent!", Fun::native(&Transient::persistent));
+  pGlobalScope->setValue("str-cat",     Fun::native([](Rest rest) {
+    auto pStr = new Str();
+    for (size_t i = 0; i < rest.count; i++) {
+      pStr = Str::cat(pStr, as<Str>(rest.ppArgs[i]));
+    }
+    return pStr;
+  }));
+  pGlobalScope->setValue("substr",      Fun::native([](Str* pStr, int start, 
+                                                       Optional<int> length) {
+    int count = length.valueOr(int(pStr->size()));
+    if (start < 0 || count < 0) {
+      throw std::runtime_error("Index out of range!");
+    }
+    return pStr->substr(start, count);
+  }));
+  pGlobalScope->setValue("str-len",     Fun::native([](Str* pStr) {
+    return int(pStr->size());
+  }));
+  pGlobalScope->setValue("str-index",   Fun::native([](Str* pStr, 
+                                                       Str* pNeedle) {
+    auto index = pStr->flat().find(pNeedle->flat());
+    return index == std::string::npos ? -1 : int(index);
+  }));
+  pGlobalScope->setValue("pmap",        Fun::native(&pmap));
+  pGlobalScope->setValue("pfilter",     Fun::native(&pfilter));
+  pGlobalScope->setValue("preduce",     Fun::native(&preduce));
+  pGlobalScope->setValue("await",       Fun::native(&Future::await));
+  pGlobalScope->setValue("future-ready?", Fun::native(&Future::ready));
+  pGlobalScope->setValue("spawn",       Fun::native([](Fun* pFun, Rest rest) {
+    return scheduler.spawn(pFun, rest.ppArgs, rest.count);
+  }));
+  pGlobalScope->setValue("chan",        Fun::native([](Optional<int> size) {
+    int capacity = size.valueOr(0);
+    if (capacity < 0) {
+      throw std::runtime_error("Channel capacity must not be negative!");
+    }
+    return new Chan(capacity);
+  }));
+  pGlobalScope->setValue("send",        Fun::native([](Chan* pChan, Expr* pValue) {
+    return scheduler.send(pChan, pValue);
+  }));
+  pGlobalScope->setValue("recv",        Fun::native([](Chan* pChan) {
+    return scheduler.recv(pChan);
+  }));
+  pGlobalScope->setValue("close",       Fun::native([](Chan* pChan) {
+    scheduler.close(pChan);
+  }));
+  pGlobalScope->setValue("yield",       Fun::native([]() {
+    scheduler.yield();
   }));
   pGlobalScope->setValue("print",  new Fun([](List* pArgs, Scope* pScope) {
     while (pArgs) {
       auto pValue = pArgs->pHead;
       if (pValue) {
-        pValue = pValue->eval(pScope);  
-        pValue->print();
+        pValue = evalExpr(pValue, pScope);  
+        printExpr(pValue);
       }
       pArgs = pArgs->pTail;  
     }
@@ -229,87 +907,96 @@ void initGlobalScope() {
     while (pArgs) {
       auto pValue = pArgs->pHead;
       if (pValue) {
-        pValue = pValue->eval(pScope);  
-        pValue->print();
+        pValue = evalExpr(pValue, pScope);  
+        printExpr(pValue);
       }
       pArgs = pArgs->pTail;  
     }
     std::cout << std::endl;
     return nil;
   }));
-  pGlobalScope->setValue("prompt",  new Fun([](List* pArgs, Scope* pScope) {
+  pGlobalScope->setValue("prompt",  Fun::strict([](Expr**, size_t) {
     std::string input;
     std::getline(std::cin, input);
     return new Str(input);
   }));
-  pGlobalScope->setValue("begin",  new Fun([](List* pArgs, Scope* pScope) {
-    Expr* pValue = 0;
-    while (pArgs) {
-      auto pItem = pArgs->pHead;
-      if (pItem) {
-        pValue = pItem->eval(pScope);  
-      }
-      pArgs = pArgs->pTail;  
-    }
-    return pValue;
+  pGlobalScope->setValue("gc",  Fun::strict([](Expr**, size_t) {
+    gc.collect();
+    return nil;
+  }));
+  pGlobalScope->setValue("heap",  Fun::strict([](Expr**, size_t) {
+    auto& stats = gc.stats();
+    std::cout << stats.cells       << " cells, " 
+              << stats.bytes       << " bytes, " 
+              << stats.collections << " collections, " 
+              << stats.freedCells  << " freed, pause last/max/total " 
+              << stats.lastPause   << "/" 
+              << stats.maxPause    << "/" 
+              << stats.totalPause  << "ms" << std::endl;
+    return nil;
+  }));
+  pGlobalScope->setValue("stats",  Fun::strict([](Expr**, size_t) {
+    return stats();
   }));
   pGlobalScope->setValue("nil", nil);
 };
 
-Expr* buildExpr(ParseNode* pNode);
+Expr* buildExpr(ParseNode* pNode, const Str::Text& source);
 
-List*  buildListFromTail (ParseNode* pNode) {
+List*  buildListFromTail (ParseNode* pNode, const Str::Text& source) {
   if (!pNode) return nil;
 
-  auto pLeft  = pNode->pLeft.get();
-  auto pRight = pNode->pRight.get();
+  auto pLeft  = pNode->pLeft;
+  auto pRight = pNode->pRight;
 
   if (pLeft && pLeft->context == ITEM) {
-    return new List(buildExpr(pLeft), buildListFromTail(pRight));
+    return new List(buildExpr(pLeft, source), 
+                    buildListFromTail(pRight, source));
   } else {
-    return buildListFromTail(pRight);
+    return buildListFromTail(pRight, source);
   }
 }
 
-Expr* buildExpr(ParseNode* pNode) {
+// Builds the expression a parse tree read from source describes
+Expr* buildExpr(ParseNode* pNode, const Str::Text& source) {
   if (!pNode) {
     throw std::runtime_error("cannot build expression from null node");
   }
 
   // build terminal nodes
   if (pNode->context == SYM) { 
-    return new Sym(pNode);
+    return Sym::intern(pNode->match.str());
   }
 
   if (pNode->context == STR) { 
-    return new Str(pNode);
+    return new Str(source, pNode);
   }
 
   if (pNode->context == INT) { 
-    return new Int(pNode);
+    return Int::box(atoi(pNode->match.str().c_str()));
   }
 
   if (pNode->context == FLOAT) { 
-    return new Float(pNode);
+    return Float::box(atof(pNode->match.str().c_str()));
   }
 
   // recursively build list
   if (pNode->context == LIST) {
-    return buildExpr(pNode->pRight.get());
+    return buildExpr(pNode->pRight, source);
   }
 
   if (pNode->context == TAIL) {
-    return buildListFromTail(pNode);
+    return buildListFromTail(pNode, source);
   }
   
   // If we only have a left side...
-  if (pNode->pLeft.get() && !pNode->pRight.get()) {
-    return buildExpr(pNode->pLeft.get());
+  if (pNode->pLeft && !pNode->pRight) {
+    return buildExpr(pNode->pLeft, source);
   }
 
   // If we only have a right side...
-  if (!pNode->pLeft.get() && pNode->pRight.get()) {
-    return buildExpr(pNode->pRight.get());
+  if (!pNode->pLeft && pNode->pRight) {
+    return buildExpr(pNode->pRight, source);
   }
 
   throw std::runtime_error("cannot build expression from unknown node");
@@ -320,7 +1007,7 @@ Lexer::Lexer() {
   digit     = range('0', '9');
   ualpha    = range('A', 'Z');
   lalpha    = range('a', 'z');
-  symbol    = any("+-*/%:;.$,?!|=<>~#\\");
+  symbol    = any("+-*/%:;.$,?!|=<>~#&\\");
 
   alpha     = ualpha   | lalpha;
   alphanum  = alpha    | digit;
@@ -361,25 +1048,31 @@ NonTerminal<ITEM>  item;
 NonTerminal<SEXPR> sexpr; 
 NonTerminal<PROG>  program;
 
-void load(std::string path) {
+void load(const std::string& path) {
   std::ifstream t(path);
   std::stringstream buffer;
   buffer << t.rdbuf();
-  std::string prelude = buffer.str(); 
 
-  std::string input = prelude;
-  auto b = input.begin();
-  auto e = input.end();
+  // String literals are slices of the source, which they keep alive
+  auto pSource = std::make_shared<std::string>(buffer.str());
+  auto b = pSource->begin();
+  auto e = pSource->end();
+
+  // Each form's parse tree is dropped in one go once it has been built
+  ParseArena      arena;
+  ParseArena::Use useArena(arena);
 
   try {
     while (b < e) { 
+      gc.poll();
+
+      RootScope  roots;
       ParseNode* pRoot  = program.parse(b, e);
       //pRoot->print();
-      Expr* pExprRoot = buildExpr(pRoot);
-      pExprRoot = pExprRoot->eval(pGlobalScope.get());
-      pExprRoot->print();
-      delete pRoot;
-      //delete pExprRoot;
+      Expr* pExprRoot = rootExpr(prepare(buildExpr(pRoot, pSource)));
+      arena.reset();
+      pExprRoot = evalTopLevel(pExprRoot);
+      printExpr(pExprRoot);
       std::cout << std::endl;
     }
   }
@@ -388,43 +1081,89 @@ void load(std::string path) {
   }
 }
 
-int main () {
-  try {
-    atom    = lex.space + (lex.flt | lex.num | lex.str | lex.sym);
-    item    = !sexpr;
+// Evaluates every form in source, returning the value of the last one
+Expr* evalSource(const std::string& source) {
+  auto pSource = std::make_shared<std::string>(source);
+  auto b = pSource->begin();
+  auto e = pSource->end();
+
+  ParseArena      arena;
+  ParseArena::Use useArena(arena);
+
+  Expr* pValue = nil;
+  while (b < e) { 
+    gc.poll();
 
-    head    = lex.oparen;
-    tail    = lex.cparen | (item + !tail);
-    list    = lex.space + (head + tail); 
+    RootScope  roots;
+    ParseNode* pRoot  = program.parse(b, e);
+    Expr* pExprRoot = rootExpr(prepare(buildExpr(pRoot, pSource)));
+    arena.reset();
+    pValue = evalTopLevel(pExprRoot);
+  }
+  return pValue;
+}
+
+void initGrammar() {
+  atom    = lex.space + (lex.flt | lex.num | lex.str | lex.sym);
+  item    = !sexpr;
+
+  head    = lex.oparen;
+  tail    = lex.cparen | (item + !tail);
+  list    = lex.space + (head + tail); 
 
-    sexpr   = atom | list;   
-    program = lex.space + sexpr;
+  sexpr   = atom | list;   
+  program = lex.space + sexpr;
+}
+
+// The benchmarks include this file whole and bring their own main
+#ifndef CORVID_NO_MAIN
+int main (int argc, char** argv) {
+  for (int arg = 1; arg < argc; arg++) {
+    if (std::string(argv[arg]) == "--vm") {
+      useVm = true;
+    }
+  }
 
+  try {
+    initGrammar();
     initGlobalScope();
 
-    std::string input = "(load \"prelude.cvd\")";
-    auto b = input.begin();
-    auto e = input.end();
+    if (auto path = getenv("CORVID_METRICS_SOCKET")) {
+      metricsRegistry.serve(path);
+    }
+
+    // Each line read is a source of its own
+    auto pInput = std::make_shared<std::string>("(load \"prelude.cvd\")");
+    auto b = pInput->begin();
+    auto e = pInput->end();
+
+    ParseArena      arena;
+    ParseArena::Use useArena(arena);
+
     while (!std::cin.eof()) {
       if (b < e) {
         try {
+          gc.poll();
+
+          RootScope  roots;
           ParseNode* pRoot  = program.parse(b, e);
           //pRoot->print();
-          Expr* pExprRoot = buildExpr(pRoot);
-          pExprRoot = pExprRoot->eval(pGlobalScope.get());
-          pExprRoot->print();
-          delete pRoot;
-          //delete pExprRoot;
+          Expr* pExprRoot = rootExpr(prepare(buildExpr(pRoot, pInput)));
+          arena.reset();
+          pExprRoot = evalTopLevel(pExprRoot);
+          printExpr(pExprRoot);
         }
         catch (std::exception& e) {
           std::cout << e.what() << std::endl;
         }
+        Str::scratch().clear();
       }
 
       std::cout << std::endl << ">>> ";
-      std::getline(std::cin, input);
-      b = input.begin();
-      e = input.end();
+      pInput = std::make_shared<std::string>();
+      std::getline(std::cin, *pInput);
+      b = pInput->begin();
+      e = pInput->end();
     }
   } 
   catch (std::exception& e) {
@@ -433,5 +1172,6 @@ int main () {
   
   return 0;
 }
+#endif
 
 //------------------------------------------------------------------------------